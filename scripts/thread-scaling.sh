@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# End-to-end thread scaling benchmark for minimac.
+#
+# Simulates a reference panel and target array with minimac-simulate,
+# then runs minimac-omp at 1..N threads. Each thread count gets one full
+# run (estimation followed by imputation) and one run that only imputes,
+# reusing the fitted .rec/.erate files. Estimation time is the difference
+# between the two. Reports throughput, parallel efficiency and dosage
+# concordance against the simulated truth as tab-delimited text.
+#
+# Usage: thread-scaling.sh [-b bindir] [-o workdir] [-t maxthreads]
+#                          [-r rounds] [-s states] [-- simulate options]
+
+BINDIR=$(dirname "$0")/../bin
+WORKDIR=scaling
+THREADS=$(nproc 2>/dev/null || echo 4)
+ROUNDS=5
+STATES=200
+
+while getopts "b:o:t:r:s:h" opt; do
+   case $opt in
+      b) BINDIR=$OPTARG ;;
+      o) WORKDIR=$OPTARG ;;
+      t) THREADS=$OPTARG ;;
+      r) ROUNDS=$OPTARG ;;
+      s) STATES=$OPTARG ;;
+      *) sed -n '3,15p' "$0"; exit 1 ;;
+   esac
+done
+shift $((OPTIND - 1))
+
+SIMULATE=$BINDIR/minimac-simulate
+MINIMAC=$BINDIR/minimac-omp
+
+for exe in $SIMULATE $MINIMAC; do
+   if [ ! -x $exe ]; then
+      echo "Could not find $exe -- run 'make openmp' and 'make simulate' first" >&2
+      exit 1
+   fi
+done
+
+mkdir -p $WORKDIR || exit 1
+DATA=$WORKDIR/simulated
+
+$SIMULATE --prefix $DATA "$@" > $WORKDIR/simulate.log || exit 1
+
+REFERENCE=$(grep -c . $DATA.ref.haps)
+TARGETS=$(grep -c . $DATA.haps)
+MARKERS=$(grep -c . $DATA.ref.snps)
+
+ESTIMATED=$(( STATES < REFERENCE ? STATES : REFERENCE ))
+TARGETSTATES=$(( STATES < TARGETS ? STATES : TARGETS ))
+ESTIMATED=$(( ESTIMATED * ROUNDS + TARGETSTATES * (ROUNDS - ROUNDS / 2) ))
+
+now() { date +%s.%N; }
+elapsed() { awk -v a=$(now) -v b=$1 'BEGIN { print a - b }'; }
+
+# Squared correlation and mean absolute error between two dose files
+concordance() {
+   awk -F'\t' '
+      NR == FNR { for (i = 3; i <= NF; i++) truth[$1, i] = $i; next }
+      {
+      for (i = 3; i <= NF; i++)
+         {
+         x = $i; y = truth[$1, i]; n++
+         sx += x; sy += y; sxx += x * x; syy += y * y; sxy += x * y
+         err += x > y ? x - y : y - x
+         }
+      }
+      END {
+      vx = n * sxx - sx * sx; vy = n * syy - sy * sy
+      r2 = vx > 0 && vy > 0 ? (n * sxy - sx * sy) ^ 2 / (vx * vy) : 0
+      printf "%.4f\t%.4f", r2, (n ? err / n : 0)
+      }' $1 $2
+}
+
+COMMON="--refHaps $DATA.ref.haps --refSnps $DATA.ref.snps --haps $DATA.haps --snps $DATA.snps --states $STATES"
+
+printf "# %d reference haplotypes, %d target haplotypes, %d markers, %d rounds\n" \
+       $REFERENCE $TARGETS $MARKERS $ROUNDS
+printf "Threads\tEstimationSeconds\tEstimationHapsPerSecond\tEstimationEfficiency\t"
+printf "ImputationSeconds\tImputationHapsPerSecond\tImputationEfficiency\tDoseRsq\tDoseMeanAbsError\n"
+
+THREADLIST=$(t=1; while [ $t -lt $THREADS ]; do echo $t; t=$((t * 2)); done; echo $THREADS)
+
+for t in $THREADLIST; do
+   PREFIX=$WORKDIR/threads$t
+
+   start=$(now)
+   $MINIMAC $COMMON --rounds $ROUNDS --cpus $t --prefix $PREFIX.fit > $PREFIX.fit.log || exit 1
+   total=$(elapsed $start)
+
+   start=$(now)
+   $MINIMAC $COMMON --rounds 0 --rec $PREFIX.fit.rec --erate $PREFIX.fit.erate \
+            --cpus $t --prefix $PREFIX > $PREFIX.log || exit 1
+   impute=$(elapsed $start)
+
+   estimate=$(awk -v a=$total -v b=$impute 'BEGIN { print (a > b ? a - b : 0) }')
+
+   if [ $t -eq 1 ]; then
+      estimate1=$estimate
+      impute1=$impute
+   fi
+
+   awk -v t=$t -v e=$estimate -v i=$impute -v e1=$estimate1 -v i1=$impute1 \
+       -v eh=$ESTIMATED -v ih=$TARGETS -v c="$(concordance $DATA.truth.dose $PREFIX.dose)" \
+       'BEGIN { printf "%d\t%.2f\t%.1f\t%.3f\t%.2f\t%.1f\t%.3f\t%s\n",
+                t, e, (e > 0 ? eh / e : 0), (e > 0 ? e1 / (t * e) : 0),
+                i, (i > 0 ? ih / i : 0), (i > 0 ? i1 / (t * i) : 0), c }'
+done
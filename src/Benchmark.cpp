@@ -0,0 +1,489 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Error.h"
+#include "IntArray.h"
+#include "Parameters.h"
+#include "StringArray.h"
+#include "MemoryAllocators.h"
+#include "MathVector.h"
+#include "Random.h"
+#include "MarkovModel.h"
+
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+// Micro-benchmarks for the MarkovModel kernels. Each kernel is run over
+// a synthetic panel for a grid of state and marker counts and timings
+// are reported as tab-delimited text, one line per configuration.
+
+static double WallTime()
+   {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return now.tv_sec + now.tv_nsec * 1e-9;
+   }
+
+// Accumulates results so the compiler cannot discard kernel calls
+static double checksum = 0.0;
+
+class BenchmarkPanel
+   {
+   public:
+      int      states, markers;
+      char **  haplotypes;
+      float ** freqs;
+      char *   observed;
+      char *   major;
+      char *   minor;
+      char **  flags;
+      float *  probs;
+
+      BenchmarkPanel(int states, int markers);
+      ~BenchmarkPanel();
+   };
+
+BenchmarkPanel::BenchmarkPanel(int STATES, int MARKERS)
+   {
+   states = STATES;
+   markers = MARKERS;
+
+   haplotypes = AllocateCharMatrix(states, markers);
+   freqs = AllocateFloatMatrix(5, markers);
+   observed = new char [markers];
+   major = new char [markers];
+   minor = new char [markers];
+   flags = AllocateCharMatrix(markers, states);
+   probs = new float [states + 1];
+
+   // Biallelic markers, with a spread of allele frequencies
+   for (int j = 0; j < markers; j++)
+      {
+      double p = globalRandom.Next() * 0.5;
+
+      for (int i = 0; i < states; i++)
+         {
+         haplotypes[i][j] = globalRandom.Next() < p ? 2 : 1;
+         flags[j][i] = haplotypes[i][j] == 2;
+         }
+
+      for (int a = 0; a < 5; a++)
+         freqs[a][j] = 0.0;
+
+      freqs[1][j] = 1.0 - p;
+      freqs[2][j] = p;
+      major[j] = 1;
+      minor[j] = 2;
+      observed[j] = globalRandom.Next() < p ? 2 : 1;
+      }
+
+   for (int i = 0; i <= states; i++)
+      probs[i] = globalRandom.Next();
+   }
+
+BenchmarkPanel::~BenchmarkPanel()
+   {
+   FreeCharMatrix(haplotypes, states);
+   FreeFloatMatrix(freqs, 5);
+
+   delete [] observed;
+   delete [] major;
+   delete [] minor;
+   FreeCharMatrix(flags, markers);
+   delete [] probs;
+   }
+
+// Each kernel returns elapsed seconds for one sweep over all markers
+typedef double (* Kernel)(MarkovModel & mm, BenchmarkPanel & panel);
+
+static double TransposeKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   double start = WallTime();
+
+   for (int i = 0; i < panel.markers - 1; i++)
+      mm.Transpose(mm.matrix[i], mm.matrix[i + 1], mm.R[i]);
+
+   double elapsed = WallTime() - start;
+
+   checksum += mm.matrix[panel.markers - 1][0];
+
+   return elapsed;
+   }
+
+static double ConditionKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   double start = WallTime();
+
+   for (int i = 0; i < panel.markers; i++)
+      mm.Condition(mm.matrix[i], panel.haplotypes, i, panel.observed[i],
+                   mm.E[i], panel.freqs[panel.observed[i]][i]);
+
+   double elapsed = WallTime() - start;
+
+   checksum += mm.matrix[panel.markers - 1][0];
+
+   // Undo the conditioning so repeated sweeps do not underflow
+   for (int i = 0; i < panel.markers; i++)
+      for (int j = 0; j < panel.states; j++)
+         mm.matrix[i][j] = panel.probs[j];
+
+   return elapsed;
+   }
+
+static double ImputeKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   double start = WallTime();
+
+   for (int i = 0; i < panel.markers; i++)
+      mm.Impute(panel.major, panel.observed, mm.matrix[i], panel.haplotypes, panel.freqs, i);
+
+   double elapsed = WallTime() - start;
+
+   checksum += mm.imputedHap[panel.markers - 1];
+
+   return elapsed;
+   }
+
+// Runs a kernel with the two allele specializations enabled
+static double Biallelic(Kernel kernel, MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   mm.commonAllele = panel.major;
+   mm.minorAllele = panel.minor;
+   mm.minorFlags = panel.flags;
+
+   double elapsed = kernel(mm, panel);
+
+   mm.commonAllele = mm.minorAllele = NULL;
+   mm.minorFlags = NULL;
+
+   return elapsed;
+   }
+
+static double ConditionBiallelicKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   return Biallelic(ConditionKernel, mm, panel);
+   }
+
+static double ImputeBiallelicKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   return Biallelic(ImputeKernel, mm, panel);
+   }
+
+static double CountErrorsKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   double sum = 0.0;
+   double start = WallTime();
+
+   for (int i = 0; i < panel.markers; i++)
+      sum += mm.CountErrors(mm.matrix[i], panel.haplotypes, i, panel.observed[i],
+                            mm.E[i], panel.freqs[panel.observed[i]][i]);
+
+   double elapsed = WallTime() - start;
+
+   checksum += sum;
+
+   return elapsed;
+   }
+
+static double CountRecombinantsKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   double sum = 0.0;
+   double start = WallTime();
+
+   for (int i = 0; i < panel.markers - 1; i++)
+      sum += mm.CountRecombinants(mm.matrix[i + 1], mm.matrix[i], mm.R[i]);
+
+   double elapsed = WallTime() - start;
+
+   checksum += sum;
+
+   return elapsed;
+   }
+
+static double ProfileModelKernel(MarkovModel & mm, BenchmarkPanel & panel)
+   {
+   double start = WallTime();
+
+   mm.ProfileModel(panel.observed, panel.haplotypes, panel.freqs);
+
+   double elapsed = WallTime() - start;
+
+   checksum += mm.empE[0];
+
+   return elapsed;
+   }
+
+struct KernelInfo
+   {
+   const char * name;
+   Kernel       kernel;
+   double       bytesPerState;
+   };
+
+// Bytes touched per state and marker: float vectors read or written,
+// plus one byte per state for the haplotype lookup
+static KernelInfo kernels[] =
+   {
+      { "Transpose",          TransposeKernel,          8.0 },
+      { "Condition",          ConditionKernel,          9.0 },
+      { "ConditionBiallelic", ConditionBiallelicKernel, 9.0 },
+      { "Impute",             ImputeKernel,             5.0 },
+      { "ImputeBiallelic",    ImputeBiallelicKernel,    5.0 },
+      { "CountErrors",        CountErrorsKernel,        5.0 },
+      { "CountRecombinants",  CountRecombinantsKernel,  8.0 },
+      { "ProfileModel",       ProfileModelKernel,       4.0 },
+      { NULL,                 NULL,                     0.0 }
+   };
+
+// Full sweeps with each forward matrix format, compared with the float
+// path. A third of markers are masked, so they are truly imputed.
+static void AccuracyReport(BenchmarkPanel & panel, int repeats, IFILE out)
+   {
+   int formats[] = { PRECISION_FLOAT, PRECISION_BF16, PRECISION_F16 };
+   const char * names[] = { "float", "bf16", "f16" };
+
+   char * observed = new char [panel.markers];
+   for (int i = 0; i < panel.markers; i++)
+      observed[i] = i % 3 == 1 ? 0 : panel.observed[i];
+
+   Vector baseline, baselineLoo;
+
+   for (int f = 0; f < 3; f++)
+      {
+      MarkovModel mm;
+
+      mm.precision = formats[f];
+      mm.Allocate(panel.markers, panel.states);
+      mm.ClearImputedDose();
+
+      for (int i = 0; i < panel.markers; i++)
+         mm.E[i] = 0.01;
+      for (int i = 0; i < panel.markers - 1; i++)
+         mm.R[i] = 0.001;
+
+      Vector times;
+
+      for (int r = 0; r <= repeats; r++)
+         {
+         double start = WallTime();
+
+         mm.WalkLeft(observed, panel.haplotypes, panel.freqs);
+         mm.Impute(panel.major, observed, panel.haplotypes, panel.freqs);
+
+         // The first sweep is an untimed warm up
+         if (r > 0)
+            times.Push((WallTime() - start) * 1e9 / panel.markers);
+         }
+
+      times.Sort();
+
+      if (f == 0)
+         {
+         baseline = mm.imputedHap;
+         baselineLoo = mm.leaveOneOut;
+         }
+
+      double maxError = 0.0, sumError = 0.0, maxLoo = 0.0;
+
+      for (int i = 0; i < panel.markers; i++)
+         {
+         double error = fabs(mm.imputedHap[i] - baseline[i]);
+         double loo = fabs(mm.leaveOneOut[i] - baselineLoo[i]);
+
+         if (error > maxError) maxError = error;
+         if (loo > maxLoo) maxLoo = loo;
+         sumError += error;
+         }
+
+      double bytes = f == 0 ? sizeof(float) : sizeof(unsigned short);
+
+      String line;
+      line.printf("%s\t%d\t%d\t%.1f\t%.1f\t%.3g\t%.3g\t%.3g\n",
+                  names[f], panel.states, panel.markers,
+                  panel.markers * (double) panel.states * bytes / 1048576.0,
+                  times[repeats / 2], maxError, sumError / panel.markers, maxLoo);
+
+      printf("%s", (const char *) line);
+      if (out != NULL) ifprintf(out, "%s", (const char *) line);
+
+      checksum += mm.imputedHap[panel.markers - 1];
+      }
+
+   delete [] observed;
+   }
+
+static void ParseList(const String & list, IntArray & values)
+   {
+   StringArray tokens;
+
+   tokens.ReplaceTokens(list, ", ");
+
+   values.Dimension(0);
+   for (int i = 0; i < tokens.Length(); i++)
+      if (tokens[i].AsInteger() > 1)
+         values.Push(tokens[i].AsInteger());
+   }
+
+int main(int argc, char ** argv)
+   {
+   setbuf(stdout, NULL);
+
+   String stateList("100,1000,5000,10000,50000");
+   String markerList("1000,5000");
+   String kernelList("all");
+   String output;
+   int    repeats = 7, seed = 123456;
+   double maxMemory = 2048;
+   bool   accuracy = false;
+
+   BEGIN_LONG_PARAMETERS(longParameters)
+      LONG_PARAMETER_GROUP("Benchmark Grid")
+         LONG_STRINGPARAMETER("states", &stateList)
+         LONG_STRINGPARAMETER("markers", &markerList)
+         LONG_STRINGPARAMETER("kernels", &kernelList)
+         LONG_DOUBLEPARAMETER("maxMemory", &maxMemory)
+         LONG_PARAMETER("accuracy", &accuracy)
+      LONG_PARAMETER_GROUP("Timing")
+         LONG_INTPARAMETER("repeats", &repeats)
+         LONG_INTPARAMETER("seed", &seed)
+      LONG_PARAMETER_GROUP("Output")
+         LONG_STRINGPARAMETER("output", &output)
+   END_LONG_PARAMETERS();
+
+   ParameterList pl;
+
+   pl.Add(new LongParameters("Command Line Options", longParameters));
+   pl.Read(argc, argv);
+
+   if (repeats < 1) repeats = 1;
+
+   IntArray stateCounts, markerCounts;
+   ParseList(stateList, stateCounts);
+   ParseList(markerList, markerCounts);
+
+   StringArray selected;
+   selected.ReplaceTokens(kernelList, ", ");
+
+   IFILE out = output.IsEmpty() ? NULL : ifopen(output, "wt");
+
+   if (!output.IsEmpty() && out == NULL)
+      error("Benchmark output file [%s] could not be opened\n", (const char *) output);
+
+   char host[256] = "unknown";
+   gethostname(host, sizeof(host) - 1);
+
+   String header;
+   header.printf(accuracy ?
+                 "# minimac precision report\thost=%s\tcompiler=%s\trepeats=%d\n"
+                 "Precision\tStates\tMarkers\tForwardMB\tMedianNsPerMarker\t"
+                 "MaxDoseError\tMeanDoseError\tMaxLooError\n" :
+                 "# minimac kernel benchmark\thost=%s\tcompiler=%s\trepeats=%d\n"
+                 "Kernel\tStates\tMarkers\tRepeats\tMedianNsPerMarker\tMinNsPerMarker\t"
+                 "MadNsPerMarker\tGBPerSecond\tStateMarkersPerSecond\n",
+                 host,
+#ifdef __VERSION__
+                 __VERSION__,
+#else
+                 "unknown",
+#endif
+                 repeats);
+
+   printf("%s", (const char *) header);
+   if (out != NULL) ifprintf(out, "%s", (const char *) header);
+
+   for (int s = 0; s < stateCounts.Length(); s++)
+      for (int m = 0; m < markerCounts.Length(); m++)
+         {
+         int states = stateCounts[s];
+         int markers = markerCounts[m];
+
+         // Forward matrix plus reference panel
+         double megabytes = (double) markers * states * 5.0 / 1048576.0;
+
+         if (megabytes > maxMemory)
+            {
+            printf("# Skipping %d states x %d markers (%.0f MB exceeds --maxMemory)\n",
+                   states, markers, megabytes);
+            continue;
+            }
+
+         globalRandom.Reset(seed);
+
+         BenchmarkPanel panel(states, markers);
+
+         if (accuracy)
+            {
+            AccuracyReport(panel, repeats, out);
+            continue;
+            }
+
+         MarkovModel mm;
+
+         mm.Allocate(markers, states);
+         mm.ClearImputedDose();
+
+         for (int i = 0; i < markers; i++)
+            mm.E[i] = 0.01;
+         for (int i = 0; i < markers - 1; i++)
+            mm.R[i] = 0.001;
+
+         for (int i = 0; i < markers; i++)
+            for (int j = 0; j < states; j++)
+               mm.matrix[i][j] = panel.probs[j];
+
+         for (int k = 0; kernels[k].name != NULL; k++)
+            {
+            if (selected.Find("all") < 0 && selected.Find(kernels[k].name) < 0)
+               continue;
+
+            Vector times;
+
+            // One untimed sweep to warm caches and fault in pages
+            kernels[k].kernel(mm, panel);
+
+            for (int r = 0; r < repeats; r++)
+               times.Push(kernels[k].kernel(mm, panel) * 1e9 / markers);
+
+            times.Sort();
+
+            double median = times[repeats / 2];
+
+            Vector deviations;
+            for (int r = 0; r < repeats; r++)
+               deviations.Push(fabs(times[r] - median));
+            deviations.Sort();
+
+            double mad = deviations[repeats / 2];
+
+            String line;
+            line.printf("%s\t%d\t%d\t%d\t%.1f\t%.1f\t%.1f\t%.3f\t%.4g\n",
+                        kernels[k].name, states, markers, repeats,
+                        median, times[0], mad,
+                        kernels[k].bytesPerState * states / median,
+                        states * 1e9 / median);
+
+            printf("%s", (const char *) line);
+            if (out != NULL) ifprintf(out, "%s", (const char *) line);
+            }
+         }
+
+   if (out != NULL) ifclose(out);
+
+   printf("# checksum %g\n", checksum);
+   }
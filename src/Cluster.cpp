@@ -0,0 +1,143 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Cluster.h"
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+Cluster::Cluster()
+   {
+   rank = 0;
+   ranks = 1;
+   }
+
+void Cluster::Start(int * argc, char *** argv)
+   {
+#ifdef USE_MPI
+   // Only the main thread of each rank communicates, outside of any
+   // OpenMP parallel region
+   int provided;
+   MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+#endif
+   }
+
+void Cluster::Stop()
+   {
+#ifdef USE_MPI
+   MPI_Finalize();
+#endif
+   }
+
+void Cluster::Slice(int count, int & first, int & last)
+   {
+   first = (int) ((double) count * rank / ranks);
+   last = (int) ((double) count * (rank + 1) / ranks);
+   }
+
+void Cluster::Sum(double * values, int count)
+   {
+#ifdef USE_MPI
+   if (ranks > 1 && count > 0)
+      MPI_Allreduce(MPI_IN_PLACE, values, count, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+   }
+
+void Cluster::Sum(IntArray & values)
+   {
+#ifdef USE_MPI
+   if (ranks == 1 || values.Length() == 0) return;
+
+   int * buffer = new int [values.Length()];
+
+   for (int i = 0; i < values.Length(); i++)
+      buffer[i] = values[i];
+
+   MPI_Allreduce(MPI_IN_PLACE, buffer, values.Length(), MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+   for (int i = 0; i < values.Length(); i++)
+      values[i] = buffer[i];
+
+   delete [] buffer;
+#endif
+   }
+
+void Cluster::Sum(MarkovParameters & statistics)
+   {
+   if (ranks == 1) return;
+
+   // Counts are small enough to travel exactly as doubles
+   double counts[3] = { (double) statistics.empiricalCount,
+                        statistics.empiricalFlips,
+                        statistics.empiricalLogLikelihood };
+
+   Sum(counts, 3);
+   Sum(statistics.empR);
+   Sum(statistics.empE);
+
+   statistics.empiricalCount = (int) (counts[0] + 0.5);
+   statistics.empiricalFlips = counts[1];
+   statistics.empiricalLogLikelihood = counts[2];
+   }
+
+void Cluster::Sum(ImputationStatistics & statistics)
+   {
+   if (ranks == 1) return;
+
+   Sum(statistics.sum);
+   Sum(statistics.sumSq);
+   Sum(statistics.sumCall);
+   Sum(statistics.looSum);
+   Sum(statistics.looSumSq);
+   Sum(statistics.looProduct);
+   Sum(statistics.looObserved);
+   Sum(statistics.count);
+   Sum(statistics.looCount);
+   }
+
+void Cluster::Broadcast(double * values, int count)
+   {
+#ifdef USE_MPI
+   if (ranks > 1 && count > 0)
+      MPI_Bcast(values, count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+   }
+
+void Cluster::Broadcast(MarkovParameters & parameters)
+   {
+   if (ranks == 1) return;
+
+   double rates[2] = { parameters.empiricalFlipRate, parameters.logLikelihood };
+
+   Broadcast(rates, 2);
+   Broadcast(parameters.R);
+   Broadcast(parameters.E);
+
+   parameters.empiricalFlipRate = rates[0];
+   parameters.logLikelihood = rates[1];
+   }
+
+void Cluster::Barrier()
+   {
+#ifdef USE_MPI
+   if (ranks > 1)
+      MPI_Barrier(MPI_COMM_WORLD);
+#endif
+   }
@@ -0,0 +1,66 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "MarkovParameters.h"
+#include "ImputationStatistics.h"
+#include "MathVector.h"
+#include "IntArray.h"
+
+// Ranks of an MPI job working on one run. Each rank holds the whole
+// panel and takes a share of the haplotypes, and statistics are summed
+// across ranks. Until Start() joins the job, and always when built
+// without USE_MPI, there is a single rank and every call is a no-op.
+class Cluster
+   {
+   public:
+      int      rank, ranks;
+
+      Cluster();
+
+      // Called once per process, at the start and end of main()
+      void     Start(int * argc, char *** argv);
+      void     Stop();
+
+      bool     Distributed() { return ranks > 1; }
+
+      // Share of count tasks for this rank, as a contiguous block
+      void     Slice(int count, int & first, int & last);
+
+      // Sums in place, leaving the totals on every rank
+      void     Sum(double * values, int count);
+      void     Sum(double & value)     { Sum(&value, 1); }
+      void     Sum(Vector & values)    { Sum(values.data, values.Length()); }
+      void     Sum(IntArray & values);
+
+      // Statistics counted since the last model update
+      void     Sum(MarkovParameters & statistics);
+      void     Sum(ImputationStatistics & statistics);
+
+      // Copies the values on the first rank to every other rank
+      void     Broadcast(double * values, int count);
+      void     Broadcast(double & value)  { Broadcast(&value, 1); }
+      void     Broadcast(Vector & values) { Broadcast(values.data, values.Length()); }
+
+      // Model parameters, but not the statistics counted towards them
+      void     Broadcast(MarkovParameters & parameters);
+
+      void     Barrier();
+   };
+
+#endif
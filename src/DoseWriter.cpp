@@ -0,0 +1,203 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "DoseWriter.h"
+#include "Error.h"
+
+#include <stdio.h>
+
+DoseWriter::DoseWriter(HaplotypeSet & ref, int start, int stop) :
+   stats(ref.markerCount), reference(ref)
+   {
+   startIndex = start;
+   stopIndex = stop;
+   dosages = hapdose = haps = beam = NULL;
+   }
+
+DoseWriter::~DoseWriter()
+   {
+   Close();
+   }
+
+void DoseWriter::Open(const char * prefix, bool phased, bool gzip, bool beamReport)
+   {
+   String filename(prefix);
+
+   dosages = ifopen(filename + ".dose" + (gzip ? ".gz" : ""), "wt");
+
+   if (phased)
+      {
+      hapdose = ifopen(filename + ".hapDose" + (gzip ? ".gz" : ""), "wt");
+      haps = ifopen(filename + ".haps" + (gzip ? ".gz" : ""), "wt");
+      }
+
+   if (beamReport)
+      {
+      beam = ifopen(filename + ".beam", "wt");
+      ifprintf(beam, "Individual\tHaplotype\tStatesPerMarker\tEstimatedError\n");
+      }
+
+   extensions.Clear();
+   extensions.Push(String(".dose") + (gzip ? ".gz" : ""));
+
+   if (phased)
+      {
+      extensions.Push(String(".hapDose") + (gzip ? ".gz" : ""));
+      extensions.Push(String(".haps") + (gzip ? ".gz" : ""));
+      }
+
+   if (beamReport)
+      extensions.Push(".beam");
+   }
+
+void DoseWriter::Close()
+   {
+   if (dosages != NULL) ifclose(dosages);
+   if (hapdose != NULL) ifclose(hapdose);
+   if (haps != NULL) ifclose(haps);
+   if (beam != NULL) ifclose(beam);
+
+   dosages = hapdose = haps = beam = NULL;
+   }
+
+void DoseWriter::Merge(const char * prefix, int parts)
+   {
+   char buffer[65536];
+
+   for (int f = 0; f < extensions.Length(); f++)
+      {
+      String filename = String(prefix) + extensions[f];
+      FILE * merged = fopen(filename, "wb");
+
+      if (merged == NULL)
+         error("Can't open %s to join the output of each rank\n", (const char *) filename);
+
+      for (int rank = 0; rank < parts; rank++)
+         {
+         String part;
+         part.printf("%s.rank%d%s", prefix, rank, (const char *) extensions[f]);
+
+         FILE * input = fopen(part, "rb");
+
+         if (input == NULL)
+            error("Can't open %s, written by rank %d\n", (const char *) part, rank);
+
+         // Each rank repeats the header of the beam report
+         if (rank > 0 && extensions[f].SlowCompare(".beam") == 0)
+            for (int c = getc(input); c != EOF && c != '\n'; c = getc(input))
+               ;
+
+         size_t bytes;
+         while ((bytes = fread(buffer, 1, sizeof(buffer), input)) > 0)
+            fwrite(buffer, 1, bytes, merged);
+
+         fclose(input);
+         remove(part);
+         }
+
+      fclose(merged);
+      }
+   }
+
+void DoseWriter::Haplotype(const char * label, int haplotype, int copy,
+                           MarkovModel & mm, const char * observed)
+   {
+   stats.Update(mm.imputedHap, mm.leaveOneOut, observed, reference.major);
+
+   if (beam != NULL)
+      ifprintf(beam, "%s\tHAPLO%d\t%.1f\t%.3g\n", label, copy, mm.beamStates, mm.beamError);
+
+   if (hapdose == NULL) return;
+
+   ifprintf(hapdose, "%s\tHAPLO%d", label, copy);
+   ifprintf(haps, "%s\tHAPLO%d", label, copy);
+   for (int j = startIndex; j <= stopIndex; j++)
+      {
+      ifprintf(hapdose, "\t%.3f", mm.imputedHap[j]);
+      ifprintf(haps, "%s%c", j % 8 == 0 ? " " : "", mm.imputedAlleles[j]);
+      }
+   ifprintf(hapdose, "\n");
+   ifprintf(haps, "\n");
+   }
+
+void DoseWriter::Individual(const char * label, int individual, MarkovModel & mm)
+   {
+   ifprintf(dosages, "%s\tDOSE", label);
+   for (int j = startIndex; j <= stopIndex; j++)
+      ifprintf(dosages, "\t%.3f", mm.imputedDose[j]);
+   ifprintf(dosages, "\n");
+   }
+
+void DoseWriter::WriteDraftInfo(const char * filename, StringArray & markerNames, IntArray & markerIndex)
+   {
+   // Output some basic information
+   IFILE info = ifopen(filename, "wt");
+
+   ifprintf(info, "SNP\tAl1\tAl2\tFreq1\tGenotyped\n");
+
+   for (int i = 0, j = 0; i <= stopIndex; i++)
+      if (i >= startIndex)
+         ifprintf(info, "%s\t%s\t%s\t%.4f\t%s\n",
+            (const char *) markerNames[i],
+            reference.MajorAlleleLabel(i), reference.MinorAlleleLabel(i),
+            reference.freq[reference.major[i]][i],
+            j < markerIndex.Length() && i == markerIndex[j] ? (j++, "Genotyped") : "-");
+      else
+         if (j < markerIndex.Length() && i == markerIndex[j])
+            j++;
+
+   ifclose(info);
+   }
+
+void DoseWriter::WriteInfo(const char * filename, StringArray & markerNames, IntArray & markerIndex)
+   {
+   IFILE info = ifopen(filename, "wt");
+
+   ifprintf(info, "SNP\tAl1\tAl2\tFreq1\tMAF\tAvgCall\tRsq\tGenotyped\tLooRsq\tEmpR\tEmpRsq\tDose1\tDose2\n");
+
+   // Padded version of target haplotype, including missing sites
+   char * padded = new char [reference.markerCount];
+   for (int k = 0; k < reference.markerCount; k++)
+      padded[k] = 0;
+
+   // Mark genotyped SNPs in padded vector
+   for (int j = 0; j < markerIndex.Length(); j++)
+      if (markerIndex[j] >= 0)
+          padded[markerIndex[j]] = 1;
+
+   for (int i = startIndex; i <= stopIndex; i++)
+      {
+      ifprintf(info, "%s\t%s\t%s\t%.5f\t%.5f\t%.5f\t%.5f\t",
+            (const char *) markerNames[i],
+            reference.MajorAlleleLabel(i),
+            reference.MinorAlleleLabel(i),
+            stats.AlleleFrequency(i),
+            stats.AlleleFrequency(i) > 0.5 ? 1.0 - stats.AlleleFrequency(i) : stats.AlleleFrequency(i),
+            stats.AverageCallScore(i),
+            stats.Rsq(i));
+
+      if (padded[i])
+         ifprintf(info, "Genotyped\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\n",
+                  stats.LooRsq(i), stats.EmpiricalR(i), stats.EmpiricalRsq(i),
+                  stats.LooMajorDose(i), stats.LooMinorDose(i));
+      else
+         ifprintf(info, "-\t-\t-\t-\t-\t-\n");
+      }
+
+   ifclose(info);
+
+   delete [] padded;
+   }
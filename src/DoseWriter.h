@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DOSEWRITER_H__
+#define __DOSEWRITER_H__
+
+#include "Minimac.h"
+#include "ImputationStatistics.h"
+#include "InputFile.h"
+#include "StringArray.h"
+
+// Writes imputed haplotypes and dosages in the minimac output formats,
+// for reference markers startIndex to stopIndex, and accumulates the
+// statistics reported in the .info file.
+class DoseWriter : public ImputationOutput
+   {
+   public:
+      ImputationStatistics stats;
+
+      DoseWriter(HaplotypeSet & reference, int startIndex, int stopIndex);
+      ~DoseWriter();
+
+      // With beamReport, tracked states and estimated errors of sparse
+      // sweeps are listed for each haplotype in prefix.beam
+      void  Open(const char * prefix, bool phased, bool gzip, bool beamReport = false);
+      void  Close();
+
+      // Joins the files each of parts ranks wrote with prefix.rankN as
+      // their prefix into the usual files for prefix, in rank order, and
+      // removes them. Gzipped parts join as a multi-member gzip file.
+      void  Merge(const char * prefix, int parts);
+
+      void  WriteDraftInfo(const char * filename, StringArray & markerNames, IntArray & markerIndex);
+      void  WriteInfo(const char * filename, StringArray & markerNames, IntArray & markerIndex);
+
+      virtual void Haplotype(const char * label, int haplotype, int copy,
+                             MarkovModel & model, const char * observed);
+      virtual void Individual(const char * label, int individual, MarkovModel & model);
+
+   private:
+      HaplotypeSet & reference;
+      int            startIndex, stopIndex;
+      IFILE          dosages, hapdose, haps, beam;
+
+      // Extensions of the files opened, for Merge()
+      StringArray    extensions;
+   };
+
+#endif
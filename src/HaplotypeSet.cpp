@@ -27,22 +27,45 @@ const char * HaplotypeSet::bases[5] = {"", "A", "C", "G", "T"};
 HaplotypeSet::HaplotypeSet()
    {
    haplotypes = NULL;
+   major = NULL;
+   minor = NULL;
+   minorFlags = NULL;
+   borrowedFlags = false;
    freq = NULL;
    translate = true;
+   borrowed = false;
+   clippedRows = NULL;
+   carrierCount = carrierStart = carriers = NULL;
    markerCount = 0;
    count = 0;
    }
 
 HaplotypeSet::~HaplotypeSet()
    {
-   if (haplotypes != NULL)
+   if (haplotypes != NULL && !borrowed)
       FreeCharMatrix(haplotypes, count);
 
+   if (clippedRows != NULL)
+      delete [] clippedRows;
+
    if (freq != NULL)
       FreeFloatMatrix(freq, 5);
 
    if (major != NULL)
       delete [] major;
+
+   if (minor != NULL)
+      delete [] minor;
+
+   if (minorFlags != NULL && !borrowedFlags)
+      FreeCharMatrix(minorFlags, markerCount);
+
+   if (carrierCount != NULL)
+      {
+      delete [] carrierCount;
+      delete [] carrierStart;
+      delete [] carriers;
+      }
    }
 
 void HaplotypeSet::LoadHaplotypes(const char * filename, bool allowMissing)
@@ -87,10 +110,7 @@ void HaplotypeSet::LoadHaplotypes(IFILE & file, bool allowMissing)
       return;
 
    // Then, we allocate memory for storing the phased haplotypes
-   haplotypes = AllocateCharMatrix(count, markerCount);
-   major = new char [markerCount];
-
-   labels.Dimension(count);
+   AllocateHaplotypes(count);
 
    // And finally, we load the data in a second pass
    ifrewind(file);
@@ -104,55 +124,143 @@ void HaplotypeSet::LoadHaplotypes(IFILE & file, bool allowMissing)
 
       if (tokens.Length() == 0) continue;
 
-      labels[index] = tokens[0];
+      ParseHaplotype(tokens, index, allowMissing, line);
+      index++;
+      }
+   }
 
-      int hapstart = tokens.Length() - 1;
-      int offset = markerCount;
+void HaplotypeSet::AllocateHaplotypes(int haplotypeCount)
+   {
+   if (haplotypes != NULL && !borrowed)
+      FreeCharMatrix(haplotypes, count);
 
-      while ((offset -= tokens[hapstart].Length()) > 0 && hapstart > 0)
-         hapstart--;
+   if (clippedRows != NULL)
+      delete [] clippedRows;
 
-      if (offset != 0)
-         error("The haplotype file format was not recognized\n"
-               "(Problem occured reading haplotype #%d in line #%d)\n\n"
-               "Check that the number of markers matches the SNPs list\n",
-               ++line, ++index);
+   borrowed = false;
+   clippedRows = NULL;
 
-      for (int i = 0; i < markerCount; i++)
-         {
-         if (offset == tokens[hapstart].Length())
+   if (major == NULL)
+      major = new char [markerCount];
+
+   count = haplotypeCount;
+   haplotypes = AllocateCharMatrix(count, markerCount);
+
+   labels.Dimension(count);
+   }
+
+// Checks a haplotype line without parsing it, so that callers that
+// cannot stop on errors (such as the server) can reject it instead
+bool HaplotypeSet::CheckHaplotype(StringArray & tokens, bool allowMissing)
+   {
+   if (tokens.Length() < 2)
+      return false;
+
+   int hapstart = tokens.Length() - 1;
+   int offset = markerCount;
+
+   while ((offset -= tokens[hapstart].Length()) > 0 && hapstart > 0)
+      hapstart--;
+
+   if (offset != 0 || hapstart == 0)
+      return false;
+
+   for ( ; hapstart < tokens.Length(); hapstart++)
+      for (int i = 0; i < tokens[hapstart].Length(); i++)
+         switch (tokens[hapstart][i])
             {
-            offset = 0;
-            hapstart++;
+            case 'A' : case 'a' : case 'C' : case 'c' :
+            case 'G' : case 'g' : case 'T' : case 't' :
+               break;
+            case '1' : case '2' : case '3' : case '4' :
+               if (!translate) return false;
+               break;
+            case '0' : case '.' : case 'N' : case 'n' :
+               if (allowMissing) break;
+            default :
+               return false;
             }
 
-         char allele = tokens[hapstart][offset++];
-         char al;
+   return true;
+   }
 
-         if (translate)
-            switch (allele) {
-               case '1' : allele = 'A'; break;
-               case '2' : allele = 'C'; break;
-               case '3' : allele = 'G'; break;
-               case '4' : allele = 'T'; break;
-            }
+// Uses haplotypes held by the caller, coded as 0 (missing) or 1 to 4
+// (A, C, G, T), without copying them. The buffers must outlive the set.
+// Without names, consecutive pairs of haplotypes form one individual.
+void HaplotypeSet::UseHaplotypes(char ** buffers, int haplotypeCount, const StringArray * names)
+   {
+   if (haplotypes != NULL && !borrowed)
+      FreeCharMatrix(haplotypes, count);
 
-         switch (allele)
-               {
-               case 'A' : case 'a' : al = 1; break;
-               case 'C' : case 'c' : al = 2; break;
-               case 'G' : case 'g' : al = 3; break;
-               case 'T' : case 't' : al = 4; break;
-               case '0' : case '.' : case 'N' : case 'n' :
-                  if (allowMissing) { al = 0; break; }
-               default  :
-               error("Haplotypes can only contain alleles A ('A', 'a' or '1'),\n"
-                     "C ('C', 'c' or 2), G ('G', 'g' or 3) and T ('T', 't' or '3').\n");
-               }
+   if (clippedRows != NULL)
+      delete [] clippedRows;
+
+   if (major == NULL)
+      major = new char [markerCount];
+
+   count = haplotypeCount;
+   haplotypes = buffers;
+   borrowed = true;
+   clippedRows = NULL;
+
+   labels.Dimension(count);
+
+   for (int i = 0; i < count; i++)
+      if (names != NULL)
+         labels[i] = (*names)[i];
+      else
+         labels[i].printf("IND%d", i / 2 + 1);
+   }
 
-         haplotypes[index][i] = al;
+void HaplotypeSet::ParseHaplotype(StringArray & tokens, int index, bool allowMissing, int line)
+   {
+   labels[index] = tokens[0];
+
+   int hapstart = tokens.Length() - 1;
+   int offset = markerCount;
+
+   while ((offset -= tokens[hapstart].Length()) > 0 && hapstart > 0)
+      hapstart--;
+
+   if (offset != 0)
+      error("The haplotype file format was not recognized\n"
+            "(Problem occured reading haplotype #%d in line #%d)\n\n"
+            "Check that the number of markers matches the SNPs list\n",
+            ++line, ++index);
+
+   for (int i = 0; i < markerCount; i++)
+      {
+      if (offset == tokens[hapstart].Length())
+         {
+         offset = 0;
+         hapstart++;
          }
-      index++;
+
+      char allele = tokens[hapstart][offset++];
+      char al;
+
+      if (translate)
+         switch (allele) {
+            case '1' : allele = 'A'; break;
+            case '2' : allele = 'C'; break;
+            case '3' : allele = 'G'; break;
+            case '4' : allele = 'T'; break;
+         }
+
+      switch (allele)
+            {
+            case 'A' : case 'a' : al = 1; break;
+            case 'C' : case 'c' : al = 2; break;
+            case 'G' : case 'g' : al = 3; break;
+            case 'T' : case 't' : al = 4; break;
+            case '0' : case '.' : case 'N' : case 'n' :
+               if (allowMissing) { al = 0; break; }
+            default  :
+            error("Haplotypes can only contain alleles A ('A', 'a' or '1'),\n"
+                  "C ('C', 'c' or 2), G ('G', 'g' or 3) and T ('T', 't' or '3').\n");
+            }
+
+      haplotypes[index][i] = al;
       }
    }
 
@@ -169,16 +277,35 @@ void HaplotypeSet::LoadHaplotypes(IFILE & file, bool allowMissing)
 
    int newMarkerCount = lastMarker - firstMarker + 1;
 
+   // Borrowed buffers stay with the caller, and are clipped by pointing
+   // into them from the first marker kept
+   if (borrowed)
+      {
+      char ** rows = new char * [count];
+
+      for (int i = 0; i < count; i++)
+         rows[i] = haplotypes[i] + firstMarker;
+
+      if (clippedRows != NULL)
+         delete [] clippedRows;
+
+      haplotypes = clippedRows = rows;
+      markerCount = newMarkerCount;
+      return;
+      }
+
    char ** newHaplotypes = AllocateCharMatrix(count, newMarkerCount);
 
    for (int i = 0; i < count; i++)
       for (int j = 0; j < newMarkerCount; j++)
          newHaplotypes[i][j] = haplotypes[i][j + firstMarker];
 
-   FreeCharMatrix(haplotypes, count);
+   if (!borrowed)
+      FreeCharMatrix(haplotypes, count);
 
    haplotypes = newHaplotypes;
    markerCount = newMarkerCount;
+   borrowed = false;
    }
 
 void HaplotypeSet::ListMajorAlleles()
@@ -201,6 +328,104 @@ void HaplotypeSet::ListMajorAlleles()
       }
    }
 
+// Lists the other allele at each marker, or the major allele where there
+// is none. Returns true if no marker has a third allele or missing data,
+// so that ListMinorFlags() can be used.
+bool HaplotypeSet::ListMinorAlleles()
+   {
+   if (minor == NULL)
+      minor = new char [markerCount];
+
+   bool biallelic = true;
+
+   for (int i = 0; i < markerCount; i++)
+      {
+      minor[i] = major[i];
+
+      for (int j = 0; j < count; j++)
+         {
+         char allele = haplotypes[j][i];
+
+         if (allele == major[i] || allele == minor[i])
+            continue;
+
+         if (allele == 0 || minor[i] != major[i])
+            biallelic = false;
+         else
+            minor[i] = allele;
+         }
+      }
+
+   return biallelic;
+   }
+
+// Flags the haplotypes without the major allele, for the two allele
+// kernels. Takes as much memory again as the haplotypes.
+void HaplotypeSet::ListMinorFlags()
+   {
+   if (minorFlags == NULL)
+      minorFlags = AllocateCharMatrix(markerCount, count);
+
+   for (int j = 0; j < count; j++)
+      for (int i = 0; i < markerCount; i++)
+         minorFlags[i][j] = haplotypes[j][i] != major[i];
+   }
+
+// Borrows flags listed for the same haplotypes, such as those of a panel
+// that this set clips, from the row of its first marker. The flags stay
+// with the caller, and must outlive this set.
+void HaplotypeSet::UseMinorFlags(char ** flags)
+   {
+   if (minorFlags != NULL && !borrowedFlags)
+      FreeCharMatrix(minorFlags, markerCount);
+
+   minorFlags = flags;
+   borrowedFlags = true;
+   }
+
+// Lists haplotypes without the major allele at markers where they are
+// no more than maxFrequency of the total. Call after ListMajorAlleles().
+void HaplotypeSet::ListCarriers(double maxFrequency)
+   {
+   if (carrierCount == NULL)
+      {
+      carrierCount = new int [markerCount];
+      carrierStart = new int [markerCount];
+      }
+   else
+      delete [] carriers;
+
+   int total = 0, sparse = 0, monomorphic = 0;
+
+   for (int i = 0; i < markerCount; i++)
+      {
+      int minor = 0;
+
+      for (int j = 0; j < count; j++)
+         if (haplotypes[j][i] != major[i])
+            minor++;
+
+      carrierStart[i] = total;
+      carrierCount[i] = minor <= maxFrequency * count ? minor : -1;
+
+      if (carrierCount[i] < 0) continue;
+
+      total += minor;
+      sparse++;
+      if (minor == 0) monomorphic++;
+      }
+
+   carriers = new int [total + 1];
+
+   for (int i = 0; i < markerCount; i++)
+      if (carrierCount[i] > 0)
+         for (int j = 0, k = carrierStart[i]; j < count; j++)
+            if (haplotypes[j][i] != major[i])
+               carriers[k++] = j;
+
+   printf("  %d markers with carriers listed, %d of them monomorphic\n", sparse, monomorphic);
+   }
+
 void HaplotypeSet::CalculateFrequencies()
    {
    if (freq == NULL)
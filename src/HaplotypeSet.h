@@ -29,18 +29,46 @@ class HaplotypeSet
       StringArray labels;
       char **     haplotypes;
       char *      major;
+      char *      minor;
       float **    freq;
       bool        translate;
+      bool        borrowed;
+
+      // Row pointers into borrowed buffers, held once they are clipped
+      char **     clippedRows;
+
+      // For panels with two alleles per marker, one row per marker with
+      // a flag for each haplotype carrying the minor allele, or NULL
+      // until ListMinorFlags() or UseMinorFlags() is called
+      char **     minorFlags;
+      bool        borrowedFlags;
+
+      // Optional sparse encoding, for markers where few haplotypes carry
+      // anything but the major allele: carrierCount[i] such haplotypes,
+      // listed in carriers from carrierStart[i], or -1 where the marker
+      // is only stored densely. NULL until ListCarriers() is called.
+      int *       carrierCount;
+      int *       carrierStart;
+      int *       carriers;
 
       HaplotypeSet();
       ~HaplotypeSet();
 
       void LoadHaplotypes(const char * filename, bool allowMissing = false);
       void LoadHaplotypes(IFILE & file, bool allowMissing = false);
+      void ParseHaplotype(StringArray & tokens, int index, bool allowMissing, int line);
+      bool CheckHaplotype(StringArray & tokens, bool allowMissing);
+
+      void AllocateHaplotypes(int haplotypeCount);
+      void UseHaplotypes(char ** buffers, int haplotypeCount, const StringArray * names = NULL);
 
       void ClipHaplotypes(int & firstMarker, int & lastMarker);
 
       void ListMajorAlleles();
+      bool ListMinorAlleles();
+      void ListMinorFlags();
+      void UseMinorFlags(char ** flags);
+      void ListCarriers(double maxFrequency);
 
       void CalculateFrequencies();
       void CompareFrequencies(HaplotypeSet & sets, IntArray & index, StringArray & names);
@@ -0,0 +1,125 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "HaplotypeStream.h"
+#include "StringArray.h"
+#include "Error.h"
+
+HaplotypeStream::HaplotypeStream()
+   {
+   file = NULL;
+   translate = true;
+   allowMissing = false;
+   markerCount = 0;
+   count = 0;
+   line = 0;
+   }
+
+HaplotypeStream::~HaplotypeStream()
+   {
+   Close();
+   }
+
+void HaplotypeStream::Open(const char * filename, bool missing)
+   {
+   file = ifopen(filename, "rb");
+
+   if (file == NULL)
+      error("File [%s] with phased haplotypes could not be opened\n", filename);
+
+   allowMissing = missing;
+   pending.Clear();
+   count = line = 0;
+   }
+
+void HaplotypeStream::Close()
+   {
+   if (file != NULL)
+      ifclose(file);
+
+   file = NULL;
+   }
+
+bool HaplotypeStream::ReadLine()
+   {
+   StringArray tokens;
+
+   // Skip blank lines, leaving the next haplotype in the pending buffer
+   while (pending.IsEmpty() && file != NULL && !ifeof(file))
+      {
+      line++;
+      pending.ReadLine(file);
+      tokens.ReplaceTokens(pending);
+
+      if (tokens.Length() == 0)
+         pending.Clear();
+      }
+
+   return !pending.IsEmpty();
+   }
+
+int HaplotypeStream::ReadBatch(HaplotypeSet & batch, int batchSize)
+   {
+   StringArray lines, tokens;
+   IntArray    lineNumbers;
+   String      label;
+
+   // Collect at least batchSize haplotypes and then keep going until the
+   // current individual is complete
+   while (ReadLine())
+      {
+      tokens.ReplaceTokens(pending);
+
+      if (lines.Length() >= batchSize && tokens[0] != label)
+         break;
+
+      label = tokens[0];
+      lines.Push(pending);
+      lineNumbers.Push(line);
+      pending.Clear();
+      }
+
+   batch.markerCount = markerCount;
+   batch.translate = translate;
+   batch.AllocateHaplotypes(lines.Length());
+
+   for (int i = 0; i < lines.Length(); i++)
+      {
+      tokens.ReplaceTokens(lines[i]);
+      batch.ParseHaplotype(tokens, i, allowMissing, lineNumbers[i]);
+      }
+
+   count += batch.count;
+
+   return batch.count;
+   }
+
+int HaplotypeStream::CountHaplotypes(const char * filename)
+   {
+   int haplotypes = 0;
+
+   Open(filename, allowMissing);
+
+   while (ReadLine())
+      {
+      haplotypes++;
+      pending.Clear();
+      }
+
+   Close();
+
+   return haplotypes;
+   }
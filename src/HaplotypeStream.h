@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __HAPLOTYPESTREAM_H__
+#define __HAPLOTYPESTREAM_H__
+
+#include "HaplotypeSet.h"
+#include "InputFile.h"
+
+// Reads a haplotype file in batches, so that large target sets can be
+// imputed without holding every haplotype in memory. Consecutive lines
+// sharing a label (the two haplotypes of one individual) are never split
+// across batches.
+class HaplotypeStream
+   {
+   public:
+      int         markerCount;
+      int         count;
+      bool        translate;
+
+      HaplotypeStream();
+      ~HaplotypeStream();
+
+      void Open(const char * filename, bool allowMissing = false);
+      void Close();
+
+      int  ReadBatch(HaplotypeSet & batch, int batchSize);
+
+      // Counts the haplotypes in a file without keeping them
+      int  CountHaplotypes(const char * filename);
+
+   private:
+      IFILE       file;
+      String      pending;
+      bool        allowMissing;
+      int         line;
+
+      bool ReadLine();
+   };
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ImputationServer.h"
+#include "MarkovModel.h"
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+ImputationServer::ImputationServer(HaplotypeSet & ref, StringIntHash & hash,
+                                   MarkovParameters & mp) :
+   reference(ref), markerHash(hash), parameters(mp)
+   {
+   queueSize = 16;
+   timeout = 60;
+   maxHaplotypes = 10000;
+   maxMarkers = 1000000;
+   listener = -1;
+   shutdown = false;
+   pending = 0;
+   jobs = 0;
+   }
+
+ImputationServer::~ImputationServer()
+   {
+   if (listener >= 0)
+      {
+      close(listener);
+      unlink(socketPath);
+      }
+   }
+
+bool ImputationServer::Listen(const char * path)
+   {
+   struct sockaddr_un address;
+
+   if (strlen(path) >= sizeof(address.sun_path))
+      {
+      printf("  Socket path %s is too long\n", path);
+      return false;
+      }
+
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, path);
+
+   // A socket left behind by an earlier server would block the bind,
+   // but anything else at that path is left alone
+   struct stat status;
+
+   if (lstat(path, &status) == 0 && !S_ISSOCK(status.st_mode))
+      {
+      printf("  Could not listen on socket %s (file exists and is not a socket)\n", path);
+      return false;
+      }
+
+   unlink(path);
+
+   listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   // Only the server's own user may connect, submit jobs or shut it down
+   mode_t mask = umask(077);
+   bool bound = listener >= 0 &&
+                bind(listener, (struct sockaddr *) &address, sizeof(address)) == 0;
+   umask(mask);
+
+   if (!bound || listen(listener, queueSize) != 0)
+      {
+      printf("  Could not listen on socket %s (%s)\n", path, strerror(errno));
+
+      if (listener >= 0) close(listener);
+      listener = -1;
+
+      return false;
+      }
+
+   socketPath = path;
+
+   return true;
+   }
+
+// One thread accepts connections and queues each as a task for the
+// thread pool. Once queueSize jobs are waiting, it stops accepting until
+// one of them finishes, leaving further clients in the listen backlog.
+void ImputationServer::Serve()
+   {
+   // Clients that disconnect early must not take the server down
+   signal(SIGPIPE, SIG_IGN);
+
+   printf("  Serving imputation jobs on %s ...\n\n", (const char *) socketPath);
+
+   #pragma omp parallel
+   #pragma omp single
+      {
+      while (!shutdown)
+         {
+         int connection = accept(listener, NULL, NULL);
+
+         if (connection < 0)
+            {
+            if (errno == EINTR) continue;
+            break;
+            }
+
+         // After SHUTDOWN, this is the wake-up connection (or a late
+         // client), so drop it rather than queue it as a job
+         if (shutdown)
+            {
+            close(connection);
+            break;
+            }
+
+         // Clients that stall, sending or reading, give up their thread
+         struct timeval limit;
+
+         limit.tv_sec = timeout;
+         limit.tv_usec = 0;
+
+         setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+         setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+
+         // Without other threads, each job runs before the next is accepted
+         int threads = 1;
+#ifdef _OPENMP
+         threads = omp_get_num_threads();
+#endif
+
+         if (threads == 1)
+            {
+            RunJob(connection);
+            continue;
+            }
+
+         int queued;
+
+         #pragma omp atomic capture
+         queued = ++pending;
+
+         #pragma omp task firstprivate(connection)
+            {
+            RunJob(connection);
+
+            #pragma omp atomic
+            pending--;
+            }
+
+         // Waits for a free slot, rather than for every queued job
+         while (queued >= queueSize)
+            {
+            #pragma omp taskyield
+
+            #pragma omp atomic read
+            queued = pending;
+
+            if (queued >= queueSize)
+               usleep(1000);
+            }
+         }
+
+      #pragma omp taskwait
+      }
+
+   printf("  Server stopped after %d jobs\n", jobs);
+   }
+
+void ImputationServer::RunJob(int connection)
+   {
+   FILE * input = fdopen(connection, "r");
+   FILE * output = fdopen(dup(connection), "w");
+
+   if (input == NULL || output == NULL)
+      {
+      if (input != NULL) fclose(input); else close(connection);
+      if (output != NULL) fclose(output);
+      return;
+      }
+
+   HaplotypeSet target;
+   IntArray markerIndex;
+   String message;
+
+   if (ReadJob(input, target, markerIndex, message))
+      {
+      ImputeJob(output, target, markerIndex);
+
+      #pragma omp atomic
+      jobs++;
+      }
+   else if (!message.IsEmpty())
+      fprintf(output, "ERROR %s\n", (const char *) message);
+
+   fclose(output);
+   fclose(input);
+   }
+
+bool ImputationServer::ReadJob(FILE * input, HaplotypeSet & target,
+                               IntArray & markerIndex, String & message)
+   {
+   String buffer;
+   StringArray tokens, lines;
+
+   markerIndex.Clear();
+
+   while (true)
+      {
+      buffer.ReadLine(input);
+
+      // Allows one allele and one separator per marker, plus a label
+      if (buffer.Length() > 2 * maxMarkers + 1024)
+         {
+         message.printf("Job has lines longer than the limit for %d markers", maxMarkers);
+         return false;
+         }
+
+      tokens.ReplaceTokens(buffer);
+
+      if (tokens.Length() == 0)
+         {
+         if (ferror(input))
+            {
+            message = "Job timed out before END";
+            return false;
+            }
+
+         if (feof(input))
+            {
+            message = "Job ended before END";
+            return false;
+            }
+         continue;
+         }
+
+      if (tokens[0] == "SHUTDOWN")
+         {
+         shutdown = true;
+
+         // Wake the accepting thread so that it sees the request
+         int wake = socket(AF_UNIX, SOCK_STREAM, 0);
+         struct sockaddr_un address;
+
+         memset(&address, 0, sizeof(address));
+         address.sun_family = AF_UNIX;
+         strcpy(address.sun_path, socketPath);
+
+         if (wake >= 0)
+            {
+            connect(wake, (struct sockaddr *) &address, sizeof(address));
+            close(wake);
+            }
+
+         return false;
+         }
+
+      if (tokens[0] == "END")
+         break;
+
+      if (tokens[0] == "MARKERS")
+         {
+         if (lines.Length())
+            {
+            message = "MARKERS must precede haplotypes";
+            return false;
+            }
+
+         if (markerIndex.Length() + tokens.Length() - 1 > maxMarkers)
+            {
+            message.printf("Job lists more than %d markers", maxMarkers);
+            return false;
+            }
+
+         for (int i = 1; i < tokens.Length(); i++)
+            markerIndex.Push(markerHash.Integer(tokens[i]));
+
+         continue;
+         }
+
+      if (lines.Length() >= maxHaplotypes)
+         {
+         message.printf("Job has more than %d haplotypes", maxHaplotypes);
+         return false;
+         }
+
+      lines.Push(buffer);
+      }
+
+   int matches = 0;
+   for (int i = 0; i < markerIndex.Length(); i++)
+      if (markerIndex[i] >= 0)
+         matches++;
+
+   if (matches == 0)
+      {
+      message = "No markers overlap between target and reference";
+      return false;
+      }
+
+   if (lines.Length() == 0)
+      {
+      message = "No haplotypes";
+      return false;
+      }
+
+   target.markerCount = markerIndex.Length();
+
+   for (int i = 0; i < lines.Length(); i++)
+      {
+      tokens.ReplaceTokens(lines[i]);
+
+      if (!target.CheckHaplotype(tokens, true))
+         {
+         message.printf("Haplotype %d does not match the %d markers listed",
+                        i + 1, target.markerCount);
+         return false;
+         }
+      }
+
+   target.AllocateHaplotypes(lines.Length());
+
+   for (int i = 0; i < lines.Length(); i++)
+      {
+      tokens.ReplaceTokens(lines[i]);
+      target.ParseHaplotype(tokens, i, true, i);
+      }
+
+   return true;
+   }
+
+void ImputationServer::ImputeJob(FILE * output, HaplotypeSet & target, IntArray & markerIndex)
+   {
+   MarkovModel mm;
+
+   mm.Allocate(reference.markerCount, reference.count);
+   mm.CopyParameters(parameters);
+
+   char * padded = new char [reference.markerCount];
+   String line;
+
+   for (int i = 0; i < target.count; )
+      {
+      mm.ClearImputedDose();
+
+      int k = i;
+
+      do {
+         for (int j = 0; j < reference.markerCount; j++)
+            padded[j] = 0;
+
+         for (int j = 0; j < target.markerCount; j++)
+            if (markerIndex[j] >= 0)
+               padded[markerIndex[j]] = target.haplotypes[k][j];
+
+         mm.WalkLeft(padded, reference.haplotypes, reference.freq);
+         mm.Impute(reference.major, padded, reference.haplotypes, reference.freq);
+
+         k++;
+      } while (k < target.count && target.labels[k] == target.labels[i]);
+
+      // Dosages are sent back as soon as each individual is done
+      line.printf("%s\tDOSE", (const char *) target.labels[i]);
+      for (int j = 0; j < reference.markerCount; j++)
+         line.catprintf("\t%.3f", mm.imputedDose[j]);
+
+      fprintf(output, "%s\n", (const char *) line);
+      fflush(output);
+
+      i = k;
+      }
+
+   fprintf(output, "END\n");
+
+   delete [] padded;
+   }
@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __IMPUTATIONSERVER_H__
+#define __IMPUTATIONSERVER_H__
+
+#include "HaplotypeSet.h"
+#include "MarkovParameters.h"
+#include "StringHash.h"
+
+#include <stdio.h>
+
+// Serves imputation jobs over a Unix domain socket, keeping the reference
+// panel and fitted model parameters in memory between jobs. Each
+// connection carries one job:
+//
+//    MARKERS name1 name2 ...       (may be repeated to extend the list)
+//    <haplotypes, one per line, in the same format as --haps>
+//    END
+//
+// The reply has one line per individual, in the format of the .dose
+// file, followed by END. Malformed jobs get a single ERROR line instead.
+// A connection that sends SHUTDOWN stops the server once running jobs
+// are complete. Clients that stall for more than timeout seconds while
+// sending a job or reading its reply are dropped, so that they can't hold
+// a worker thread, unless timeout is 0. The socket is created with mode
+// 0600, so only the user running the server can connect to it. Jobs with
+// more than maxHaplotypes haplotypes or maxMarkers markers are refused.
+class ImputationServer
+   {
+   public:
+      int   queueSize;
+      int   timeout;
+      int   maxHaplotypes;
+      int   maxMarkers;
+
+      ImputationServer(HaplotypeSet & reference, StringIntHash & markerHash,
+                       MarkovParameters & parameters);
+      ~ImputationServer();
+
+      bool  Listen(const char * path);
+      void  Serve();
+
+   private:
+      HaplotypeSet &     reference;
+      StringIntHash &    markerHash;
+      MarkovParameters & parameters;
+
+      String   socketPath;
+      int      listener;
+      volatile bool shutdown;
+      int      pending;
+      int      jobs;
+
+      void     RunJob(int connection);
+      bool     ReadJob(FILE * input, HaplotypeSet & target, IntArray & markerIndex, String & message);
+      void     ImputeJob(FILE * output, HaplotypeSet & target, IntArray & markerIndex);
+   };
+
+#endif
@@ -38,6 +38,9 @@ class ImputationStatistics
       double EmpiricalRsq(int marker);
 
    private:
+      // Sums the statistics of each rank
+      friend class Cluster;
+
       Vector   sum, sumSq, sumCall, looSum, looSumSq, looProduct, looObserved;
       IntArray count, looCount;
    };
@@ -0,0 +1,499 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "JobManifest.h"
+#include "StringArray.h"
+#include "InputFile.h"
+#include "Error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+ManifestJob::ManifestJob()
+   {
+   output = NULL;
+   startIndex = stopIndex = 0;
+   }
+
+ManifestJob::~ManifestJob()
+   {
+   if (output != NULL) delete output;
+   }
+
+JobManifest::JobManifest()
+   {
+   phased = gzip = false;
+   jobs = NULL;
+   count = 0;
+   }
+
+JobManifest::~JobManifest()
+   {
+   for (int j = 0; j < count; j++)
+      if (jobs[j] != NULL)
+         delete jobs[j];
+
+   if (jobs != NULL) delete [] jobs;
+   }
+
+void JobManifest::Read(const char * filename)
+   {
+   IFILE input = ifopen(filename, "rb");
+
+   if (input == NULL)
+      error("Job manifest [%s] could not be opened\n", filename);
+
+   StringArray lines;
+   IntArray    lineNumbers;
+   String      buffer;
+
+   for (int line = 1; !ifeof(input); line++)
+      {
+      buffer.ReadLine(input);
+      buffer.Trim();
+
+      if (buffer.IsEmpty() || buffer[0] == '#') continue;
+
+      lines.Push(buffer);
+      lineNumbers.Push(line);
+      }
+
+   ifclose(input);
+
+   count = lines.Length();
+   jobs = new ManifestJob * [count];
+
+   StringArray tokens;
+
+   for (int j = 0; j < count; j++)
+      {
+      tokens.ReplaceTokens(lines[j]);
+
+      if (tokens.Length() != 7)
+         error("Line %d of job manifest [%s] has %d fields, but jobs need 7: reference haplotypes,\n"
+               "reference markers, target haplotypes, target markers, first and last marker, and prefix\n",
+               lineNumbers[j], filename, tokens.Length());
+
+      ManifestJob * job = jobs[j] = new ManifestJob;
+
+      job->referenceHaplotypes = tokens[0];
+      job->referenceSnps = tokens[1];
+      job->haplotypes = tokens[2];
+      job->snps = tokens[3];
+      job->firstMarker = tokens[4];
+      job->lastMarker = tokens[5];
+      job->prefix = tokens[6];
+      }
+
+   printf("  %d Jobs Listed in Manifest ...\n\n", count);
+   }
+
+int JobManifest::Run(Minimac & settings)
+   {
+   Cluster & cluster = settings.cluster;
+
+   IntArray started(count);
+   started.Zero();
+
+   int run = 0;
+
+   // Each panel is loaded once for all of this rank's jobs that share it
+   for (int j = 0; j < count; j++)
+      {
+      if (started[j] || j % cluster.ranks != cluster.rank) continue;
+
+      IntArray group;
+
+      for (int k = j; k < count; k++)
+         if (!started[k] && k % cluster.ranks == cluster.rank &&
+             jobs[k]->referenceHaplotypes == jobs[j]->referenceHaplotypes &&
+             jobs[k]->referenceSnps == jobs[j]->referenceSnps)
+            {
+            group.Push(k);
+            started[k] = 1;
+            }
+
+      run += RunPanel(settings, group);
+      }
+
+   return run;
+   }
+
+static bool Readable(const char * filename)
+   {
+   IFILE input = ifopen(filename, "rb");
+
+   if (input == NULL) return false;
+
+   ifclose(input);
+   return true;
+   }
+
+// Returns the first line of a haplotype file that LoadHaplotypes() would
+// stop on, or 0 if all of them can be loaded
+static int BadHaplotypeLine(HaplotypeSet & set, const char * filename, bool allowMissing)
+   {
+   IFILE input = ifopen(filename, "rb");
+
+   if (input == NULL) return -1;
+
+   String      buffer;
+   StringArray tokens;
+
+   int line = 0, bad = 0;
+   while (!ifeof(input) && bad == 0)
+      {
+      line++;
+      buffer.ReadLine(input);
+      tokens.ReplaceTokens(buffer);
+
+      if (tokens.Length() && !set.CheckHaplotype(tokens, allowMissing))
+         bad = line;
+      }
+
+   ifclose(input);
+   return bad;
+   }
+
+void JobManifest::SkipJob(int job, const char * reason)
+   {
+   printf("  WARNING -- Job %d for %s skipped, %s\n\n",
+          job + 1, (const char *) jobs[job]->prefix, reason);
+
+   delete jobs[job];
+   jobs[job] = NULL;
+   }
+
+int JobManifest::RunPanel(Minimac & settings, IntArray & group)
+   {
+   printf("Running %d Jobs on Reference Panel %s ...\n\n",
+          group.Length(), (const char *) jobs[group[0]]->referenceHaplotypes);
+
+   if (!Readable(jobs[group[0]]->referenceHaplotypes) || !Readable(jobs[group[0]]->referenceSnps))
+      {
+      for (int g = 0; g < group.Length(); g++)
+         SkipJob(group[g], "since its reference panel could not be opened");
+
+      return 0;
+      }
+
+   HaplotypeSet layout;
+   StringArray  panelMarkers;
+
+   panelMarkers.Read(jobs[group[0]]->referenceSnps);
+   layout.markerCount = panelMarkers.Length();
+
+   int bad = BadHaplotypeLine(layout, jobs[group[0]]->referenceHaplotypes, false);
+
+   if (bad != 0)
+      {
+      String message;
+      message.printf("since line %d of its reference panel has a bad allele "
+                     "or does not match the %d markers listed",
+                     bad, layout.markerCount);
+
+      for (int g = 0; g < group.Length(); g++)
+         SkipJob(group[g], message);
+
+      return 0;
+      }
+
+   Minimac panel;
+
+   panel.LoadReference(jobs[group[0]]->referenceHaplotypes, jobs[group[0]]->referenceSnps);
+
+   // Minor allele flags take as much memory as the panel, so they are
+   // listed once here and borrowed by every job
+   if (settings.biallelic)
+      {
+      panel.biallelic = true;
+      panel.PrepareImputation();
+      }
+
+   // Jobs that can't be prepared drop out, without stopping the others
+   IntArray ready;
+   String   message;
+
+   for (int g = 0; g < group.Length(); g++)
+      if (PrepareJob(*jobs[group[g]], panel, settings, message))
+         ready.Push(group[g]);
+      else
+         SkipJob(group[g], message);
+
+   if (ready.Length() == 0)
+      return 0;
+
+   group = ready;
+
+   EstimateJobs(group);
+
+   printf("Generating Draft .info Files ...\n\n");
+
+   for (int g = 0; g < group.Length(); g++)
+      {
+      ManifestJob & job = *jobs[group[g]];
+      Minimac & minimac = job.minimac;
+
+      if (settings.rounds > 0)
+         minimac.parameters.WriteParameters(minimac.markerNames, job.prefix, gzip);
+
+      job.output = new DoseWriter(minimac.reference, job.startIndex, job.stopIndex);
+      job.output->WriteDraftInfo(job.prefix + ".info.draft", minimac.markerNames, job.markerIndex);
+      job.output->Open(job.prefix, phased, gzip, settings.beam > 0.0);
+      }
+
+   for (int g = 0; g < group.Length(); g++)
+      jobs[group[g]]->minimac.PrepareImputation();
+
+   ImputeJobs(group);
+
+   // Jobs borrow the panel, so they finish before it is released
+   for (int g = 0; g < group.Length(); g++)
+      {
+      ManifestJob * job = jobs[group[g]];
+
+      job->output->Close();
+      job->output->WriteInfo(job->prefix + ".info" + (gzip ? ".gz" : ""),
+                             job->minimac.markerNames, job->markerIndex);
+
+      printf("  Results for job %d are in %s.*\n", group[g] + 1, (const char *) job->prefix);
+
+      delete job;
+      jobs[group[g]] = NULL;
+      }
+
+   printf("\n");
+
+   return group.Length();
+   }
+
+bool JobManifest::PrepareJob(ManifestJob & job, Minimac & panel, Minimac & settings,
+                             String & message)
+   {
+   Minimac & minimac = job.minimac;
+
+   printf("Preparing Job for %s ...\n", (const char *) job.prefix);
+
+   minimac.CopySettings(settings);
+   minimac.quiet = true;
+
+   minimac.SetReference(panel.reference.haplotypes, panel.reference.count, panel.markerNames);
+   minimac.reference.translate = panel.reference.translate;
+
+   if (!Readable(job.haplotypes) || !Readable(job.snps))
+      {
+      message = "since its target haplotypes or markers could not be opened";
+      return false;
+      }
+
+   StringArray markerList;
+   markerList.Read(job.snps);
+
+   // MapMarkers() stops the run when no marker overlaps the panel
+   int matches = 0;
+   for (int i = 0; i < markerList.Length(); i++)
+      if (panel.markerHash.Integer(markerList[i].Trim()) >= 0)
+         matches++;
+
+   if (matches == 0)
+      {
+      message = "since no markers overlap between target and reference";
+      return false;
+      }
+
+   minimac.MapMarkers(markerList, job.markerIndex, job.firstMarker, job.lastMarker);
+
+   job.startIndex = job.firstMarker.IsEmpty() ? 0 : minimac.markerHash.Integer(job.firstMarker);
+   job.stopIndex = job.lastMarker.IsEmpty() ? minimac.reference.markerCount - 1 :
+                   minimac.markerHash.Integer(job.lastMarker);
+
+   if (job.startIndex < 0 || job.stopIndex < 0)
+      {
+      message = "since clipping was requested, but no position is available for one of the endpoints";
+      return false;
+      }
+
+   // Clipped jobs borrow the flags from their first marker on, and where
+   // the panel has a third allele no job builds flags of its own
+   if (panel.reference.minorFlags != NULL)
+      minimac.reference.UseMinorFlags(panel.reference.minorFlags +
+                                      panel.markerHash.Integer(minimac.markerNames[0]));
+   else
+      minimac.biallelic = false;
+
+   job.target.markerCount = markerList.Length();
+
+   int bad = BadHaplotypeLine(job.target, job.haplotypes, true);
+
+   if (bad != 0)
+      {
+      message.printf("since line %d of its target haplotypes has a bad allele "
+                     "or does not match the %d markers listed",
+                     bad, job.target.markerCount);
+      return false;
+      }
+
+   job.target.LoadHaplotypes(job.haplotypes, true);
+
+   minimac.CheckFrequencies(job.target, job.markerIndex, markerList);
+
+   printf("  %d Target Haplotypes Loaded ...\n\n", job.target.count);
+
+   minimac.InitializeParameters();
+
+   return true;
+   }
+
+// Work for one job or individual, with its cost in state updates
+struct ScheduledTask
+   {
+   double   cost;
+   int      job, haplotype, individual;
+   };
+
+// Costliest first, then in the order listed
+static int CompareTasks(const void * a, const void * b)
+   {
+   const ScheduledTask * left = (const ScheduledTask *) a;
+   const ScheduledTask * right = (const ScheduledTask *) b;
+
+   if (left->cost != right->cost)
+      return left->cost > right->cost ? -1 : 1;
+
+   if (left->job != right->job)
+      return left->job - right->job;
+
+   return left->haplotype - right->haplotype;
+   }
+
+void JobManifest::EstimateJobs(IntArray & group)
+   {
+   ScheduledTask * tasks = new ScheduledTask [group.Length()];
+
+   for (int g = 0; g < group.Length(); g++)
+      {
+      Minimac & minimac = jobs[group[g]]->minimac;
+      int panelStates = minimac.reference.count;
+      int sampled = minimac.states < panelStates ? minimac.states : panelStates;
+
+      tasks[g].cost = (double) minimac.rounds * sampled * panelStates * minimac.reference.markerCount;
+      tasks[g].job = group[g];
+      tasks[g].haplotype = tasks[g].individual = 0;
+      }
+
+   qsort(tasks, group.Length(), sizeof(ScheduledTask), CompareTasks);
+
+   int threads = 1;
+#ifdef _OPENMP
+   threads = omp_get_max_threads();
+#endif
+
+   printf("Estimating Parameters for %d Jobs ...\n", group.Length());
+
+   // Each job runs all its rounds on one thread, unless there are too few
+   // jobs to go around, when they take turns with every thread
+   #pragma omp parallel for schedule(dynamic) if (group.Length() >= threads)
+   for (int t = 0; t < group.Length(); t++)
+      {
+      ManifestJob & job = *jobs[tasks[t].job];
+
+      job.minimac.EstimateParameters(job.target, job.markerIndex);
+      }
+
+   for (int g = 0; g < group.Length(); g++)
+      {
+      ManifestJob & job = *jobs[group[g]];
+
+      printf("  %s: %.0f mosaic crossovers expected per haplotype, %.1f%% due to reference flips\n",
+             (const char *) job.prefix, job.minimac.parameters.R.Sum(),
+             job.minimac.parameters.empiricalFlipRate * 100.);
+      }
+   printf("\n");
+
+   delete [] tasks;
+   }
+
+void JobManifest::ImputeJobs(IntArray & group)
+   {
+   // Each individual, with all of its haplotypes, is one task
+   int total = 0, haplotypes = 0;
+
+   for (int g = 0; g < group.Length(); g++)
+      haplotypes += jobs[group[g]]->target.count;
+
+   ScheduledTask * tasks = new ScheduledTask [haplotypes];
+
+   for (int g = 0; g < group.Length(); g++)
+      {
+      ManifestJob & job = *jobs[group[g]];
+      HaplotypeSet & target = job.target;
+      double updates = (double) job.minimac.reference.count * job.minimac.reference.markerCount;
+
+      for (int i = 0, individual = 0; i < target.count; individual++)
+         {
+         int next = i + 1;
+
+         while (next < target.count && target.labels[next] == target.labels[i])
+            next++;
+
+         tasks[total].cost = updates * (next - i);
+         tasks[total].job = group[g];
+         tasks[total].haplotype = i;
+         tasks[total].individual = individual;
+         total++;
+
+         i = next;
+         }
+      }
+
+   qsort(tasks, total, sizeof(ScheduledTask), CompareTasks);
+
+   printf("Imputing Genotypes for %d Jobs ...\n", group.Length());
+
+   ProgressMeter progress("haplotypes imputed", haplotypes);
+
+   #pragma omp parallel
+      {
+      // Threads reuse their model until they move on to another job
+      MarkovModel mm;
+      int current = -1;
+
+      #pragma omp for schedule(dynamic)
+      for (int t = 0; t < total; t++)
+         {
+         ManifestJob & job = *jobs[tasks[t].job];
+
+         if (tasks[t].job != current)
+            {
+            job.minimac.SetupModel(mm);
+            current = tasks[t].job;
+            }
+
+         progress.Update(job.minimac.ImputeIndividual(mm, job.target, tasks[t].haplotype,
+                                                      job.markerIndex, *job.output,
+                                                      0, tasks[t].individual));
+         }
+      }
+
+   progress.Finish();
+   printf("\n");
+
+   delete [] tasks;
+   }
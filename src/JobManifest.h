@@ -0,0 +1,90 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JOBMANIFEST_H__
+#define __JOBMANIFEST_H__
+
+#include "Minimac.h"
+#include "DoseWriter.h"
+#include "StringBasics.h"
+#include "IntArray.h"
+
+// One imputation run listed in a manifest, with its output written
+// under its own prefix for reference markers firstMarker to lastMarker,
+// which may be "start" and "stop" for the ends of the panel
+class ManifestJob
+   {
+   public:
+      String   referenceHaplotypes, referenceSnps;
+      String   haplotypes, snps;
+      String   firstMarker, lastMarker;
+      String   prefix;
+
+      // Held only while the jobs sharing its reference panel run
+      Minimac        minimac;
+      HaplotypeSet   target;
+      IntArray       markerIndex;
+      DoseWriter *   output;
+      int            startIndex, stopIndex;
+
+      ManifestJob();
+      ~ManifestJob();
+   };
+
+// Runs every job in a manifest within one process. Jobs that share a
+// reference panel run together, while one copy of the panel is loaded,
+// and borrow its haplotypes, and any minor allele flags, instead of
+// copying them. Each job still lists allele frequencies and major alleles
+// of its own, a few bytes per marker. Their parameters are estimated
+// side by side, one job per thread, and then the individuals of all the
+// jobs are imputed by one pool of threads, costliest first, so that
+// small jobs fill in around the large ones. Under mpirun, ranks take
+// turns through the jobs.
+class JobManifest
+   {
+   public:
+      bool     phased, gzip;
+
+      JobManifest();
+      ~JobManifest();
+
+      // One job per line, as whitespace separated reference haplotypes,
+      // reference markers, target haplotypes, target markers, first and
+      // last marker and output prefix. Blank lines and lines starting
+      // with # are skipped.
+      void     Read(const char * filename);
+
+      // Runs the jobs with the settings, but not the panel, of minimac.
+      // Jobs whose files can't be read, or whose markers don't match their
+      // panel, are reported and skipped. Returns the number of jobs run by
+      // this rank.
+      int      Run(Minimac & settings);
+
+      int      Length() { return count; }
+
+   private:
+      ManifestJob ** jobs;
+      int      count;
+
+      int      RunPanel(Minimac & settings, IntArray & group);
+      bool     PrepareJob(ManifestJob & job, Minimac & panel, Minimac & settings,
+                          String & message);
+      void     SkipJob(int job, const char * reason);
+      void     EstimateJobs(IntArray & group);
+      void     ImputeJobs(IntArray & group);
+   };
+
+#endif
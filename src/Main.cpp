@@ -18,11 +18,15 @@
 #include "IntArray.h"
 #include "Parameters.h"
 #include "StringArray.h"
-#include "StringHash.h"
 #include "HaplotypeSet.h"
-#include "ImputationStatistics.h"
-#include "HaplotypeClipper.h"
-#include "MarkovModel.h"
+#include "HaplotypeStream.h"
+#include "Minimac.h"
+#include "MemoryPlanner.h"
+#include "DoseWriter.h"
+#include "ImputationServer.h"
+#include "Cluster.h"
+#include "JobManifest.h"
+#include "Random.h"
 
 #include <time.h>
 
@@ -30,7 +34,15 @@
 #include <omp.h>
 #endif
 
-#define square(x)    ((x)*(x))
+static void ReportRunTime(time_t start)
+   {
+   time_t stop = time(NULL);
+   int seconds = stop - start;
+
+   printf("\nRun completed in %d hours, %d mins, %d seconds on %s\n\n",
+          seconds / 3600, (seconds % 3600) / 60, seconds % 60,
+          ctime(&stop));
+   }
 
 int main(int argc, char ** argv)
    {
@@ -38,6 +50,19 @@ int main(int argc, char ** argv)
 
    time_t start = time(NULL);
 
+   // Under mpirun, every rank runs the same steps on its share of the
+   // haplotypes, and only the first reports progress
+   Cluster cluster;
+   cluster.Start(&argc, &argv);
+
+   if (cluster.rank > 0)
+      {
+      freopen("/dev/null", "w", stdout);
+
+      // Ranks sample different paths through the MCMC
+      globalRandom.Reset(0x7654321 + cluster.rank);
+      }
+
    printf("MiniMac - Imputation into phased haplotypes\n"
           "(c) 2011 Goncalo Abecasis\n");
 #ifdef __VERSION__
@@ -46,8 +71,12 @@ int main(int argc, char ** argv)
    printf("UNDOCUMENTED RELEASE\n");
 #endif
 
-   int rounds = 5, states = 200, cpus = 0;
-   bool em = false, gzip = false, phased = false;
+   int rounds = 5, states = 200, cpus = 0, streamBatch = 0, queueSize = 16, timeout = 60;
+   int jobHaplotypes = 10000, jobMarkers = 1000000;
+   int maxMemory = 0, miniBatch = 0, window = 0, overlap = 100;
+   bool em = false, gzip = false, phased = false, metrics = false;
+   bool trace = false, perfCounters = false, numa = false, forceStateParallel = false;
+   bool meetInMiddle = false, biallelic = false;
 
    String referenceHaplotypes, referenceSnps;
    String haplotypes, snps;
@@ -55,14 +84,23 @@ int main(int argc, char ** argv)
    String firstMarker, lastMarker;
 
    String recombinationRates, errorRates;
+   String serve;
+   String precision("float");
+   String scratch;
+   String cache;
+   String manifest;
+   double beam = 0.0, sparseSites = 0.0, tolerance = 0.0, thin = 0.0;
 
    BEGIN_LONG_PARAMETERS(longParameters)
       LONG_PARAMETER_GROUP("Reference Haplotypes")
          LONG_STRINGPARAMETER("refHaps", &referenceHaplotypes)
          LONG_STRINGPARAMETER("refSnps", &referenceSnps)
+         LONG_DOUBLEPARAMETER("sparseSites", &sparseSites)
+         LONG_PARAMETER("biallelic", &biallelic)
       LONG_PARAMETER_GROUP("Target Haplotypes")
          LONG_STRINGPARAMETER("haps", &haplotypes)
          LONG_STRINGPARAMETER("snps", &snps)
+         LONG_INTPARAMETER("streamBatch", &streamBatch)
       LONG_PARAMETER_GROUP("Starting Parameters")
          LONG_STRINGPARAMETER("rec", &recombinationRates)
          LONG_STRINGPARAMETER("erate", &errorRates)
@@ -70,16 +108,42 @@ int main(int argc, char ** argv)
          LONG_INTPARAMETER("rounds", &rounds)
          LONG_INTPARAMETER("states", &states)
          LONG_PARAMETER("em", &em)
+         LONG_DOUBLEPARAMETER("tolerance", &tolerance)
+         LONG_INTPARAMETER("miniBatch", &miniBatch)
+         LONG_DOUBLEPARAMETER("thin", &thin)
+         LONG_STRINGPARAMETER("cache", &cache)
+         LONG_INTPARAMETER("window", &window)
+         LONG_INTPARAMETER("overlap", &overlap)
       LONG_PARAMETER_GROUP("Output Files")
          LONG_STRINGPARAMETER("prefix", &prefix)
          LONG_PARAMETER("phased", &phased)
          LONG_PARAMETER("gzip", &gzip)
+         LONG_PARAMETER("metrics", &metrics)
+         LONG_PARAMETER("trace", &trace)
+         LONG_PARAMETER("perfCounters", &perfCounters)
+      LONG_PARAMETER_GROUP("Memory Use")
+         LONG_STRINGPARAMETER("precision", &precision)
+         LONG_INTPARAMETER("maxMemory", &maxMemory)
+         LONG_STRINGPARAMETER("scratch", &scratch)
+      LONG_PARAMETER_GROUP("Approximation")
+         LONG_DOUBLEPARAMETER("beam", &beam)
+      LONG_PARAMETER_GROUP("Multiple Jobs")
+         LONG_STRINGPARAMETER("manifest", &manifest)
+      LONG_PARAMETER_GROUP("Server Mode")
+         LONG_STRINGPARAMETER("serve", &serve)
+         LONG_INTPARAMETER("queue", &queueSize)
+         LONG_INTPARAMETER("timeout", &timeout)
+         LONG_INTPARAMETER("jobHaplotypes", &jobHaplotypes)
+         LONG_INTPARAMETER("jobMarkers", &jobMarkers)
 //    LONG_PARAMETER_GROUP("Clipping Window")
 //      LONG_STRINGPARAMETER("start", &firstMarker)
 //      LONG_STRINGPARAMETER("stop", &lastMarker)
 #ifdef _OPENMP
       LONG_PARAMETER_GROUP("Multi-Threading")
          LONG_INTPARAMETER("cpus", &cpus)
+         LONG_PARAMETER("numa", &numa)
+         LONG_PARAMETER("stateParallel", &forceStateParallel)
+         LONG_PARAMETER("meetInMiddle", &meetInMiddle)
 #endif
    END_LONG_PARAMETERS();
 
@@ -94,380 +158,305 @@ int main(int argc, char ** argv)
       omp_set_num_threads(cpus);
 #endif
 
-   // Read marker list
-   printf("Reading Reference Marker List ...\n");
 
-   StringArray refMarkerList;
-   refMarkerList.Read(referenceSnps);
+   if (cluster.Distributed() && !serve.IsEmpty())
+      error("Server mode runs in a single process, not under mpirun\n");
 
-   // Index markers
-   StringIntHash referenceHash;
-   for (int i = 0; i < refMarkerList.Length(); i++)
-      referenceHash.Add(refMarkerList[i].Trim(), i);
+   Minimac minimac;
 
-   printf("  %d Markers in Reference Haplotypes...\n\n", refMarkerList.Length());
+   minimac.cluster = cluster;
+   minimac.rounds = rounds;
+   minimac.states = states;
+   minimac.em = em;
+   minimac.tolerance = tolerance;
+   minimac.miniBatch = miniBatch;
 
-   // Load reference haplotypes
-   printf("Loading reference haplotypes ...\n");
-   HaplotypeSet reference;
+   if (thin < 0.0 || thin > 0.5)
+      error("The --thin option should be a minor allele frequency up to 0.5\n");
 
-   reference.markerCount = refMarkerList.Length();
-   reference.LoadHaplotypes(referenceHaplotypes);
+   minimac.thin = thin;
+   minimac.cache = cache;
 
-   printf("  %d Reference Haplotypes Loaded ...\n\n", reference.count);
+   if (window < 0 || overlap < 1)
+      error("The --window option should be a number of markers, with an --overlap of at least 1\n");
 
-   // Read framework marker list
-   printf("Reading Framework Marker List ...\n");
-   StringArray markerList;
-   markerList.Read(snps);
+   minimac.window = window;
+   minimac.overlap = overlap;
+   minimac.numa = numa;
+   minimac.meetInMiddle = meetInMiddle;
+   minimac.forceStateParallel = forceStateParallel;
 
-   ClipReference(reference, refMarkerList, referenceHash, markerList,
-                 firstMarker, lastMarker);
+   if (precision.SlowCompare("float") == 0)
+      minimac.precision = PRECISION_FLOAT;
+   else if (precision.SlowCompare("bf16") == 0)
+      minimac.precision = PRECISION_BF16;
+   else if (precision.SlowCompare("f16") == 0)
+      minimac.precision = PRECISION_F16;
+   else
+      error("Unknown --precision [%s], expected float, bf16 or f16\n", (const char *) precision);
 
-   // Crossref Marker Names to Reference Panel Positions
-   IntArray markerIndex;
-   markerIndex.Dimension(markerList.Length());
+   if (beam < 0.0 || beam >= 1.0)
+      error("The --beam option should be a fraction of mass between 0 and 1\n");
 
-   int matches = 0;
+   minimac.beam = beam;
+   minimac.scratch = scratch;
 
-   for (int i = 0; i < markerList.Length(); i++)
-      {
-      markerIndex[i] = referenceHash.Integer(markerList[i].Trim());
+   if (sparseSites < 0.0 || sparseSites > 0.5)
+      error("The --sparseSites option should be a minor allele frequency up to 0.5\n");
 
-      if (markerIndex[i] >= 0) matches++;
-      }
+   minimac.sparseSites = sparseSites;
+   minimac.biallelic = biallelic;
 
-   printf("  %d Markers in Framework Haplotypes Overlap Reference ...\n", matches);
-
-   if (matches == 0)
-      error("No markers overlap between target and reference\n"
-            "Please check correct reference is being used and markers are named consistently");
-
-   printf("  %d Other Markers in Framework Haplotypes Discarded ...\n\n", markerList.Length() - matches);
-
-   // Check for flips in reference vs. target haplotypes
-   int flips = 0;
-   int previous = -1;
-   for (int i = 0; i < markerIndex.Length(); i++)
-      if (markerIndex[i] >= 0)
-         if (markerIndex[i] < previous)
-            {
-            if (flips++ < 10)
-               printf("  -> Marker %s precedes %s in reference, but follows it in target\n",
-                     (const char *) refMarkerList[previous],
-                     (const char *) markerList[i]);
-            previous = markerIndex[i];
-            }
-   if (flips > 10)
-      printf("  -> %d Additional Marker Order Changes Not Listed\n", flips - 10);
-   if (flips)
-      printf("  %d Marker Pairs Change Order in Target vs Framework Haplotypes\n", flips);
+   if (trace)
+      minimac.tracer.Enable();
 
-   // Load target haplotypes
-   printf("Loading target haplotypes ...\n");
-   HaplotypeSet target;
+   if (perfCounters)
+      minimac.counters.Enable();
 
-   target.markerCount = markerList.Length();
-   target.LoadHaplotypes(haplotypes, true);
+   // Each job in a manifest lists its own panels and output prefix
+   if (!manifest.IsEmpty())
+      {
+      if (!referenceHaplotypes.IsEmpty() || !referenceSnps.IsEmpty() ||
+          !haplotypes.IsEmpty() || !snps.IsEmpty() ||
+          !recombinationRates.IsEmpty() || !errorRates.IsEmpty() ||
+          streamBatch > 0 || maxMemory > 0 || metrics || trace || perfCounters ||
+          numa || !serve.IsEmpty())
+         error("Panels, starting parameters and outputs are listed for each job in a --manifest,\n"
+               "which can't be combined with --refHaps, --refSnps, --haps, --snps, --rec, --erate,\n"
+               "--streamBatch, --maxMemory, --metrics, --trace, --perfCounters, --numa or --serve\n");
 
-   reference.CalculateFrequencies();
-   target.CalculateFrequencies();
-   target.CompareFrequencies(reference, markerIndex, markerList);
+      printf("Reading Job Manifest ...\n");
 
-   printf("  %d Target Haplotypes Loaded ...\n\n", target.count);
+      JobManifest jobs;
 
-   int startIndex = firstMarker.IsEmpty() ? 0 : referenceHash.Integer(firstMarker);
-   int stopIndex = lastMarker.IsEmpty() ? reference.markerCount - 1 : referenceHash.Integer(lastMarker);
+      jobs.phased = phased;
+      jobs.gzip = gzip;
+      jobs.Read(manifest);
+      jobs.Run(minimac);
 
-   if (startIndex < 0 || stopIndex < 0)
-      error("Clipping requested, but no position available for one of the endpoints");
-
-   printf("Setting up Markov Model...\n\n");
+      ReportRunTime(start);
 
-   // Setup Markov Model
-   MarkovParameters mp;
+      cluster.Stop();
+      return 0;
+      }
 
-   mp.Allocate(reference.markerCount);
+   HaplotypeSet & reference = minimac.reference;
+   RunMetrics & runMetrics = minimac.metrics;
 
-   if (rounds > 0)
-      printf("Initializing Model Parameters (using %s and up to %d haplotypes)\n",
-             em ? "E-M" : "MCMC", states);
+   minimac.LoadReference(referenceHaplotypes, referenceSnps);
 
-   // Simple initial estimates of error and recombination rate
-   for (int i = 0; i < reference.markerCount; i++)
-      mp.E[i] = 0.01;
+   // Read framework marker list
+   runMetrics.BeginPhase("TargetMarkers");
+   printf("Reading Framework Marker List ...\n");
+   StringArray markerList;
 
-   for (int i = 0; i < reference.markerCount - 1; i++)
-      mp.R[i] = 0.001;
+   // A server without targets of its own fits parameters on the reference
+   if (!serve.IsEmpty() && snps.IsEmpty())
+      markerList = minimac.markerNames;
+   else
+      markerList.Read(snps);
 
-   if (mp.ReadErrorRates(errorRates))
-      printf("  Updated error rates using data in %s ...\n", (const char *) errorRates);
+   IntArray markerIndex;
+   minimac.MapMarkers(markerList, markerIndex, firstMarker, lastMarker);
+   runMetrics.EndPhase();
 
-   if (mp.ReadCrossoverRates(recombinationRates))
-      printf("  Updated recombination rates using %s ...\n", (const char *) recombinationRates);
+   // Fit threads, target batches and forward storage to a memory budget
+#ifdef _OPENMP
+   int estimationThreads = 0, imputationThreads = 0;
+#endif
 
-   // Parameter estimation loop
-   for (int round = 0; round < rounds; round++)
+   if (maxMemory > 0)
       {
-      printf("  Round %d of Parameter Refinement ...\n", round + 1);
-
-      int iterations = states < reference.count ? states : reference.count;
-
-      MarkovModel original;
-      original.CopyParameters(mp);
-
-      #pragma omp parallel for
-      for (int i = 0; i < iterations; i++)
+      MemoryPlanner planner;
+      HaplotypeStream counter;
+
+      planner.markers = reference.markerCount;
+      planner.haplotypes = reference.count;
+      planner.targetMarkers = markerList.Length();
+      planner.targetHaplotypes = haplotypes.IsEmpty() ? 0 : counter.CountHaplotypes(haplotypes);
+      planner.rounds = rounds;
+      planner.states = states;
+      planner.sparseSites = sparseSites;
+      planner.streamBatch = streamBatch;
+      planner.scratch = !scratch.IsEmpty();
+      planner.biallelic = biallelic;
+
+      if (minimac.precision != PRECISION_FLOAT)
          {
-         MarkovModel mm;
-
-         mm.Allocate(reference.markerCount, reference.count - 1);
-         mm.CopyParameters(original);
+         planner.precision = minimac.precision;
+         planner.requiredPrecision = true;
+         }
 
-         // Reference leave one out (loo) panel
-         char ** reference_loo = new char * [reference.count - 1];
-         for (int in = 0, out = 0; in < reference.count; in++)
-            if (in != i)
-               reference_loo[out++] = reference.haplotypes[in];
+#ifdef _OPENMP
+      planner.maxThreads = omp_get_max_threads();
+#endif
 
-         mm.WalkLeft(reference.haplotypes[i], reference_loo, reference.freq);
+      if (!planner.Plan(maxMemory * 1048576.0))
+         error("Imputation needs more than the %d MB allowed by --maxMemory, even on one thread\n",
+               maxMemory);
 
-         if (em)
-            mm.CountExpected(reference.haplotypes[i], reference_loo, reference.freq);
-         else
-            {
-            #pragma omp critical
-            { mm.ProfileModel(reference.haplotypes[i], reference_loo, reference.freq); }
-            }
+      planner.Print();
 
-         delete [] reference_loo;
+      streamBatch = planner.batch;
 
-         #pragma omp critical
-         mp += mm;
-         }
+#ifdef _OPENMP
+      estimationThreads = planner.estimationThreads;
+      imputationThreads = planner.threads;
+#endif
 
-      if (round >= rounds / 2)
+      // Sparse sweeps size their own rows
+      if (beam == 0.0)
          {
-         int iterations = states < target.count ? states : target.count;
-
-         #pragma omp parallel for
-         for (int i = 0; i < iterations; i++)
-            {
-            MarkovModel mm;
-
-            mm.Allocate(reference.markerCount, reference.count);
-            mm.CopyParameters(original);
-
-            // Padded version of target haplotype, including missing sites
-            char * padded = new char [reference.markerCount];
-            for (int k = 0; k < reference.markerCount; k++)
-               padded[k] = 0;
+         minimac.checkpoint = planner.checkpoint;
+         if (planner.storage == STORAGE_REDUCED)
+            minimac.precision = planner.precision;
+         }
+      }
 
-            // Copy current haplotype into padded vector
-            for (int j = 0; j < target.markerCount; j++)
-               if (markerIndex[j] >= 0)
-                  padded[markerIndex[j]] = target.haplotypes[i][j];
+   // Load target haplotypes
+   runMetrics.BeginPhase("TargetHaplotypes");
+   printf("Loading target haplotypes ...\n");
+   HaplotypeSet target;
+   HaplotypeStream stream;
 
-            mm.WalkLeft(padded, reference.haplotypes, reference.freq);
+   target.markerCount = markerList.Length();
 
-            if (em)
-               mm.CountExpected(padded, reference.haplotypes, reference.freq);
-            else
-               {
-               #pragma omp critical
-               { mm.ProfileModel(padded, reference.haplotypes, reference.freq); }
-               }
+   if (streamBatch > 0)
+      {
+      // Only the first batch is held in memory ahead of imputation; it is
+      // also used for frequency checks and parameter estimation
+      stream.markerCount = markerList.Length();
+      stream.Open(haplotypes, true);
+      stream.ReadBatch(target, streamBatch > states ? streamBatch : states);
+      }
+   else if (serve.IsEmpty() || !haplotypes.IsEmpty())
+      target.LoadHaplotypes(haplotypes, true);
+   runMetrics.EndPhase(target.count);
 
-            delete [] padded;
+   minimac.CheckFrequencies(target, markerIndex, markerList);
 
-            #pragma omp critical
-            mp += mm;
-            }
-         }
+   if (streamBatch > 0)
+      printf("  %d Target Haplotypes in First Batch, Remainder Streamed in Batches of %d ...\n\n",
+             target.count, streamBatch);
+   else
+      printf("  %d Target Haplotypes Loaded ...\n\n", target.count);
 
-      mp.UpdateModel();
+   int startIndex = firstMarker.IsEmpty() ? 0 : minimac.markerHash.Integer(firstMarker);
+   int stopIndex = lastMarker.IsEmpty() ? reference.markerCount - 1 : minimac.markerHash.Integer(lastMarker);
 
-      double crossovers = 0;
-      for (int i = 0; i < reference.markerCount - 1; i++)
-         crossovers += mp.R[i];
+   if (startIndex < 0 || stopIndex < 0)
+      error("Clipping requested, but no position available for one of the endpoints");
 
-      double errors = 0;
-      for (int i = 0; i < reference.markerCount; i++)
-         {
-         double heterozygosity = 1.0 - square(reference.freq[1][i])
-                                     - square(reference.freq[2][i])
-                                     - square(reference.freq[3][i])
-                                     - square(reference.freq[4][i]);
+#ifdef _OPENMP
+   if (estimationThreads > 0)
+      omp_set_num_threads(estimationThreads);
+#endif
 
-         errors += mp.E[i] * heterozygosity;
-         }
-      errors /= reference.markerCount + 1e-30;
+   minimac.InitializeParameters(recombinationRates, errorRates);
+   minimac.EstimateParameters(target, markerIndex);
 
-      printf("      %.0f mosaic crossovers expected per haplotype\n", crossovers);
-      printf("      %.1f%% of crossovers are due to reference flips\n", mp.empiricalFlipRate * 100.);
-      printf("      %.3g errors in mosaic expected per marker\n", errors);
-      }
+   runMetrics.BeginPhase("ParameterOutput");
 
-   if (rounds > 0)
+   if (rounds > 0 && cluster.rank == 0)
       {
       printf("  Saving estimated parameters for future use ...\n");
-      mp.WriteParameters(refMarkerList, prefix, gzip);
+      minimac.parameters.WriteParameters(minimac.markerNames, prefix, gzip);
       }
 
    printf("\n");
 
-   // List the major allele at each location
-   reference.ListMajorAlleles();
-
-   printf("Generating Draft .info File ...\n\n");
-
-   // Output some basic information
-   IFILE info = ifopen(prefix + ".info.draft", "wt");
-
-   ifprintf(info, "SNP\tAl1\tAl2\tFreq1\tGenotyped\n");
+   if (!serve.IsEmpty())
+      {
+      runMetrics.EndPhase();
 
-   for (int i = 0, j = 0; i <= stopIndex; i++)
-      if (i >= startIndex)
-         ifprintf(info, "%s\t%s\t%s\t%.4f\t%s\n",
-            (const char *) refMarkerList[i],
-            reference.MajorAlleleLabel(i), reference.MinorAlleleLabel(i),
-            reference.freq[reference.major[i]][i],
-            j < markerIndex.Length() && i == markerIndex[j] ? (j++, "Genotyped") : "-");
-      else
-         if (j < markerIndex.Length() && i == markerIndex[j])
-            j++;
+      ImputationServer server(reference, minimac.markerHash, minimac.parameters);
 
-   ifclose(info);
+      server.queueSize = queueSize;
+      server.timeout = timeout;
+      server.maxHaplotypes = jobHaplotypes;
+      server.maxMarkers = jobMarkers;
 
-   printf("Imputing Genotypes ...\n");
+      if (!server.Listen(serve))
+         error("Server could not be started on socket %s\n", (const char *) serve);
 
-   IFILE dosages = ifopen(prefix + ".dose" + (gzip ? ".gz" : ""), "wt");
-   IFILE hapdose, haps;
+      server.Serve();
 
-   if (phased)
-      {
-      hapdose = ifopen(prefix + ".hapDose" + (gzip ? ".gz" : ""), "wt");
-      haps = ifopen(prefix + ".haps" + (gzip ? ".gz" : ""), "wt");
+      cluster.Stop();
+      return 0;
       }
 
-   ImputationStatistics stats(reference.markerCount);
+   printf("Generating Draft .info File ...\n\n");
 
-   // Impute each haplotype
-   #pragma omp parallel for
-   for (int i = 0; i < target.count; i++)
-      {
-      if (i != 0 && target.labels[i] == target.labels[i-1])
-         continue;
+   DoseWriter output(reference, startIndex, stopIndex);
 
-      MarkovModel mm;
+   if (cluster.rank == 0)
+      output.WriteDraftInfo(prefix + ".info.draft", minimac.markerNames, markerIndex);
+   runMetrics.EndPhase();
 
-      mm.Allocate(reference.markerCount, reference.count);
-      mm.ClearImputedDose();
-      mm.CopyParameters(mp);
+   runMetrics.BeginPhase("Imputation");
+   printf("Imputing Genotypes ...\n");
 
-      // Padded version of target haplotype, including missing sites
-      char * padded = new char [reference.markerCount];
-      for (int j = 0; j < reference.markerCount; j++)
-         padded[j] = 0;
+   // Each rank writes its individuals to files of its own, which the
+   // first rank joins once all are done
+   String outputPrefix(prefix);
 
-      int k = i;
+   if (cluster.Distributed())
+      {
+      printf("  Imputing across %d ranks ...\n", cluster.ranks);
+      outputPrefix.catprintf(".rank%d", cluster.rank);
+      }
 
-      do {
-         printf("  Processing Haplotype %d of %d ...\n", k + 1, target.count);
+   output.Open(outputPrefix, phased, gzip, beam > 0.0);
 
-         // Copy current haplotype into padded vector
-         for (int j = 0; j < target.markerCount; j++)
-            if (markerIndex[j] >= 0)
-               padded[markerIndex[j]] = target.haplotypes[k][j];
+#ifdef _OPENMP
+   if (imputationThreads > 0)
+      omp_set_num_threads(imputationThreads);
+#endif
 
-         mm.WalkLeft(padded, reference.haplotypes, reference.freq);
-         mm.Impute(reference.major, padded, reference.haplotypes, reference.freq);
+   int imputed = minimac.Impute(target, markerIndex, output,
+                                streamBatch > 0 ? &stream : NULL, streamBatch);
 
-         #pragma omp critical
-         { stats.Update(mm.imputedHap, mm.leaveOneOut, padded, reference.major); }
+   stream.Close();
+   output.Close();
 
-         #pragma omp critical
-         if (phased)
-            {
-            ifprintf(hapdose, "%s\tHAPLO%d", (const char *) target.labels[i], k - i + 1);
-            ifprintf(haps, "%s\tHAPLO%d", (const char *) target.labels[i], k - i + 1);
-            for (int j = startIndex; j <= stopIndex; j++)
-               {
-               ifprintf(hapdose, "\t%.3f", mm.imputedHap[j]);
-               ifprintf(haps, "%s%c", j % 8 == 0 ? " " : "", mm.imputedAlleles[j]);
-               }
-            ifprintf(hapdose, "\n");
-            ifprintf(haps, "\n");
-            }
+   runMetrics.EndPhase(imputed, (double) imputed * reference.count * reference.markerCount);
 
-         k++;
-      } while (k < target.count && target.labels[k] == target.labels[i]);
+   // Output some basic information
+   runMetrics.BeginPhase("InfoOutput");
+   cluster.Barrier();
+   cluster.Sum(output.stats);
 
-      printf("    Outputting Individual %s ...\n", (const char *) target.labels[i]);
+   if (cluster.Distributed() && cluster.rank == 0)
+      output.Merge(prefix, cluster.ranks);
 
-      #pragma omp critical
-         {
-         ifprintf(dosages, "%s\tDOSE", (const char *) target.labels[i]);
-         for (int j = startIndex; j <= stopIndex; j++)
-            ifprintf(dosages, "\t%.3f", mm.imputedDose[j]);
-         ifprintf(dosages, "\n");
-         }
+   if (cluster.rank == 0)
+      output.WriteInfo(prefix + ".info" + (gzip ? ".gz" : ""), minimac.markerNames, markerIndex);
+   runMetrics.EndPhase();
 
-      delete [] padded;
-      }
+   if (beam > 0.0)
+      printf("Estimated beam search errors for each haplotype are in %s\n",
+             (const char *) (prefix + ".beam"));
 
-   ifclose(dosages);
+   minimac.counters.Report();
 
-   if (phased)
+   if (metrics && cluster.rank == 0)
       {
-      ifclose(hapdose);
-      ifclose(haps);
+      int threads = 1;
+#ifdef _OPENMP
+      threads = omp_get_max_threads();
+#endif
+      printf("\nWriting run metrics to %s ...\n", (const char *) (prefix + ".metrics.json"));
+      runMetrics.WriteJSON(prefix + ".metrics.json", threads);
       }
 
-   // Output some basic information
-   info = ifopen(prefix + ".info" + (gzip ? ".gz" : ""), "wt");
-
-   ifprintf(info, "SNP\tAl1\tAl2\tFreq1\tMAF\tAvgCall\tRsq\tGenotyped\tLooRsq\tEmpR\tEmpRsq\tDose1\tDose2\n");
-
-   // Padded version of target haplotype, including missing sites
-   char * padded = new char [reference.markerCount];
-   for (int k = 0; k < reference.markerCount; k++)
-      padded[k] = 0;
-
-   // Mark genotyped SNPs in padded vector
-   for (int j = 0; j < target.markerCount; j++)
-      if (markerIndex[j] >= 0)
-          padded[markerIndex[j]] = 1;
-
-   for (int i = startIndex; i <= stopIndex; i++)
+   if (trace && cluster.rank == 0)
       {
-      ifprintf(info, "%s\t%s\t%s\t%.5f\t%.5f\t%.5f\t%.5f\t",
-            (const char *) refMarkerList[i],
-            reference.MajorAlleleLabel(i),
-            reference.MinorAlleleLabel(i),
-            stats.AlleleFrequency(i),
-            stats.AlleleFrequency(i) > 0.5 ? 1.0 - stats.AlleleFrequency(i) : stats.AlleleFrequency(i),
-            stats.AverageCallScore(i),
-            stats.Rsq(i));
-
-      if (padded[i])
-         ifprintf(info, "Genotyped\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\n",
-                  stats.LooRsq(i), stats.EmpiricalR(i), stats.EmpiricalRsq(i),
-                  stats.LooMajorDose(i), stats.LooMinorDose(i));
-      else
-         ifprintf(info, "-\t-\t-\t-\t-\t-\n");
+      printf("Writing timeline trace to %s ...\n", (const char *) (prefix + ".trace.json"));
+      minimac.tracer.WriteJSON(prefix + ".trace.json");
       }
 
-   ifclose(info);
-
-   delete [] padded;
-
-   time_t stop = time(NULL);
-   int seconds = stop - start;
+   ReportRunTime(start);
 
-   printf("\nRun completed in %d hours, %d mins, %d seconds on %s\n\n",
-          seconds / 3600, (seconds % 3600) / 60, seconds % 60,
-          ctime(&stop));
+   cluster.Stop();
    }
 
-
@@ -19,6 +19,11 @@
 #include "Random.h"
 
 #include <stdio.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define FREE_ARRAY(ptr)    { if ((ptr) != NULL) delete [] ptr; ptr = NULL; }
 
@@ -29,25 +34,62 @@ MarkovModel::MarkovModel()
    backgroundError = 1e-5;
 
    matrix = NULL;
+
+   stateThreads = 1;
+   partials = NULL;
+   rescales = 0;
+
+   precision = PRECISION_FLOAT;
+   reduced = NULL;
+
+   checkpoint = 0;
+   checkpointRows = NULL;
+   checkpointInterval = 0;
+
+   beam = 0.0;
+   beamStates = beamError = beamTracked = 0.0;
+   beamStart = beamPairs = NULL;
+   beamValues = beamBackground = NULL;
+   beamCapacity = 0;
+   alleleCounts = NULL;
+   countedHaplotypes = NULL;
+
+   carrierCount = carrierStart = carriers = NULL;
+   commonAllele = NULL;
+   minorAllele = NULL;
+   minorFlags = NULL;
+   carrierValues = NULL;
+   partialThreads = 0;
    }
 
 MarkovModel::~MarkovModel()
    {
    FreeMemory();
+
+   FREE_ARRAY(partials);
+   FREE_ARRAY(carrierValues);
    }
 
 void MarkovModel::Transpose(float * from, float * to, double r)
    {
-   if (r == 0)
+   double sum = 0.0;
+
+   if (r != 0)
       for (int i = 0; i < states; i++)
+         sum += from[i];
+
+   Transpose(from, to, r, sum, 0, states);
+   }
+
+// Updates states first to last - 1, given the sum over all states
+void MarkovModel::Transpose(float * from, float * to, double r, double sum, int first, int last)
+   {
+   if (r == 0)
+      for (int i = first; i < last; i++)
          to[i] = from[i];
    else
       {
       double flipRate = r * empiricalFlipRate;
-      double sum = 0.0;
-
-      for (int i = 0; i < states; i++)
-         sum += from[i];
 
       sum *= r * (1.0 - empiricalFlipRate) / states;
 
@@ -59,11 +101,13 @@ void MarkovModel::Transpose(float * from, float * to, double r)
          sum *= 1e15;
          flipRate *= 1e15;
          complement *= 1e15;
+
+         if (first == 0) rescales++;
          }
 
       // printf("r = %g, SUM = %g, COMPLEMENT = %g\n", r, sum, complement);
 
-      for (int i = 0; i < states; i++)
+      for (int i = first; i < last; i++)
          to[i] = from[i] * complement + from[i^1] * flipRate + sum;
       }
    }
@@ -71,40 +115,145 @@ void MarkovModel::Transpose(float * from, float * to, double r)
 void MarkovModel::Condition(float * vector, char ** haplotypes, int position,
                             char observed, double e, double freq)
    {
-   if (observed == 0) return;
+   if (carrierCount == NULL || carrierCount[position] < 0 || observed == 0)
+      {
+      Condition(vector, haplotypes, position, observed, e, freq, 0, states);
+      return;
+      }
 
    double pmatch = (1. - e) + e * freq + backgroundError;
    double prandom = e * freq + backgroundError;
 
+   // Every state but the carriers has the major allele, so all states are
+   // scaled alike and the carriers are then set from their saved values
+   int * list = carriers + carrierStart[position];
+   int count = carrierCount[position];
+
+   for (int k = 0; k < count; k++)
+      carrierValues[k] = vector[list[k]];
+
+   double scale = commonAllele[position] == observed ? pmatch : prandom;
+
    for (int i = 0; i < states; i++)
-      if (haplotypes[i][position] == observed)
-         vector[i] *= pmatch;
-      else
-         vector[i] *= prandom;
+      vector[i] *= scale;
+
+   for (int k = 0; k < count; k++)
+      vector[list[k]] = carrierValues[k] * (haplotypes[list[k]][position] == observed ? pmatch : prandom);
+   }
+
+
+void MarkovModel::Condition(float * vector, char ** haplotypes, int position,
+                            char observed, double e, double freq, int first, int last)
+   {
+   if (observed == 0) return;
+
+   double pmatch = (1. - e) + e * freq + backgroundError;
+   double prandom = e * freq + backgroundError;
+
+   if (minorFlags != NULL)
+      ConditionStates<true>(vector, haplotypes, position, observed, pmatch, prandom, first, last);
+   else
+      ConditionStates<false>(vector, haplotypes, position, observed, pmatch, prandom, first, last);
    }
 
 void MarkovModel::FreeMemory()
    {
-   if (matrix != NULL)
+   if (checkpointRows != NULL)
+      {
+      delete [] matrix;
+      delete [] checkpointRows;
+      }
+   else if (scratchFile.IsOpen())
+      scratchFile.Free();
+   else if (matrix != NULL)
        FreeFloatMatrix(matrix, markers);
+
+   if (reduced != NULL)
+      {
+      for (int i = 0; i < markers; i++)
+         delete [] reduced[i];
+      delete [] reduced;
+      }
+
+   FREE_ARRAY(beamStart);
+   FREE_ARRAY(beamPairs);
+   FREE_ARRAY(beamValues);
+   FREE_ARRAY(beamBackground);
+   FREE_ARRAY(alleleCounts);
+
+   matrix = NULL;
+   reduced = NULL;
+   checkpointRows = NULL;
+   checkpointInterval = 0;
+   beamCapacity = 0;
+   countedHaplotypes = NULL;
    }
 
 void MarkovModel::Allocate(int MARKERS, int STATES)
    {
-   if (markers != MARKERS || states != STATES)
+   bool sparseStorage = beam > 0.0;
+   bool reducedStorage = !sparseStorage && precision != PRECISION_FLOAT;
+   int  interval = sparseStorage || reducedStorage || checkpoint >= MARKERS ? 0 : checkpoint;
+   bool scratchStorage = !sparseStorage && !reducedStorage && interval == 0 && !scratch.IsEmpty();
+
+   if (markers != MARKERS || states != STATES || reducedStorage != (reduced != NULL) ||
+       sparseStorage != (beamStart != NULL) || interval != checkpointInterval ||
+       scratchStorage != scratchFile.IsOpen())
       {
       FreeMemory();
 
       MarkovParameters::Allocate(MARKERS);
 
       states = STATES;
-      matrix = AllocateFloatMatrix(markers, states & 1 ? states + 1 : states);
 
-      // With the possibility of flipping, we always need an even number
-      // of haplotypes. We pad the matrix as needed to reflect that.
-      if (states & 1)
+      FREE_ARRAY(carrierValues);
+      carrierValues = new float [states + 1];
+
+      if (sparseStorage)
+         {
+         // Rows are stored as they are produced, growing as needed
+         beamStart = new int [markers + 1];
+         beamBackground = new float [markers];
+         alleleCounts = new int [5 * markers];
+         }
+      else if (reducedStorage)
+         {
+         // Normalized sweeps pad their working vectors, not stored rows
+         reduced = new unsigned short * [markers];
+         for (int i = 0; i < markers; i++)
+            reduced[i] = new unsigned short [states];
+         }
+      else if (interval > 0)
+         {
+         // Checkpoints come first, then one slot for each row of a block
+         int width = states & 1 ? states + 1 : states;
+         int stored = (markers + interval - 1) / interval;
+
+         checkpointRows = new float [(size_t) (stored + interval) * width];
+         checkpointInterval = interval;
+
+         matrix = new float * [markers];
          for (int i = 0; i < markers; i++)
-            matrix[i][states] = 0.0;
+            matrix[i] = checkpointRows + (size_t) width *
+                        (i % interval == 0 ? i / interval : stored + i % interval);
+
+         if (states & 1)
+            for (int i = 0; i < stored + interval; i++)
+               checkpointRows[(size_t) i * width + states] = 0.0;
+         }
+      else
+         {
+         if (scratchStorage)
+            matrix = scratchFile.Allocate(scratch, markers, states & 1 ? states + 1 : states);
+         else
+            matrix = AllocateFloatMatrix(markers, states & 1 ? states + 1 : states);
+
+         // With the possibility of flipping, we always need an even number
+         // of haplotypes. We pad the matrix as needed to reflect that.
+         if (states & 1)
+            for (int i = 0; i < markers; i++)
+               matrix[i][states] = 0.0;
+         }
 
       imputedHap.Dimension(markers);
       imputedDose.Dimension(markers);
@@ -116,27 +265,101 @@ void MarkovModel::Allocate(int MARKERS, int STATES)
 
 void MarkovModel::WalkLeft(char * observed, char ** haplotypes, float ** freqs)
    {
+   if (beam > 0.0)
+      {
+      WalkLeftBeam(observed, haplotypes, freqs);
+      return;
+      }
+
+   if (precision == PRECISION_BF16)
+      {
+      WalkLeftNormalized<BFloat16Storage>(reduced, observed, haplotypes, freqs);
+      return;
+      }
+
+   if (precision == PRECISION_F16)
+      {
+      WalkLeftNormalized<HalfStorage>(reduced, observed, haplotypes, freqs);
+      return;
+      }
+
+   if (stateThreads > 1)
+      {
+      AllocatePartials();
+
+      #pragma omp parallel num_threads(stateThreads)
+      WalkLeftStates(observed, haplotypes, freqs);
+
+      return;
+      }
+
    // Initialize likelihoods at first position
    for (int i = 0; i < states; i++)
       matrix[0][i] = 1.;
 
+   rescales = 0;
+
    // Scan along chromosome
    for (int i = 0; i < markers - 1; i++)
       {
       if (observed[i])
          Condition(matrix[i], haplotypes, i, observed[i], E[i], freqs[observed[i]][i]);
       Transpose(matrix[i], matrix[i+1], R[i]);
+
+      scratchFile.WriteBehind(i);
       }
 
    if (observed[markers - 1])
       Condition(matrix[markers - 1], haplotypes, markers - 1, observed[markers - 1], E[markers - 1], freqs[observed[markers - 1]][markers - 1]);
+
+   // Every state starts with weight 1 rather than 1 / states
+   double sum = 0.0;
+   for (int i = 0; i < states; i++)
+      sum += matrix[markers - 1][i];
+
+   empiricalLogLikelihood += log(sum / states) - rescales * log(1e15);
    }
 
 void MarkovModel::Impute(char * major, char * observed, char ** haplotypes, float ** freqs)
    {
+   if (beam > 0.0)
+      {
+      ImputeBeam(major, observed, haplotypes, freqs);
+      return;
+      }
+
+   if (precision == PRECISION_BF16)
+      {
+      ImputeNormalized<BFloat16Storage>(reduced, major, observed, haplotypes, freqs);
+      return;
+      }
+
+   if (precision == PRECISION_F16)
+      {
+      ImputeNormalized<HalfStorage>(reduced, major, observed, haplotypes, freqs);
+      return;
+      }
+
    float * swap;
-   float * vector = new float [states];
-   float * extra = new float [states];
+   // Flips pair each state with its neighbour, so odd numbers of states
+   // need the same zero padding used for the forward matrix
+   float * vector = new float [states + 1];
+   float * extra = new float [states + 1];
+
+   vector[states] = extra[states] = 0.0;
+
+   if (stateThreads > 1)
+      {
+      AllocatePartials();
+
+      #pragma omp parallel num_threads(stateThreads)
+      ImputeStates(major, observed, haplotypes, freqs, vector, extra);
+
+      delete [] vector;
+      delete [] extra;
+
+      return;
+      }
 
    // Clear previously imputed haplotype
    // imputedHap.Zero();
@@ -149,10 +372,30 @@ void MarkovModel::Impute(char * major, char * observed, char ** haplotypes, floa
    // Scan along chromosome
    for (int i = markers - 1; i > 0; i--)
       {
-      for (int j = 0; j < states; j++)
-         extra[j] = vector[j] * matrix[i][j];
+      // WalkLeft() leaves the last block in place, earlier ones are redone
+      if (checkpointInterval > 0 && i % checkpointInterval == checkpointInterval - 1 &&
+          i < markers - 1)
+         RecomputeRows(observed, haplotypes, freqs, i);
+
+      scratchFile.ReadAhead(i);
+
+      if (carrierCount != NULL && carrierCount[i] >= 0)
+         {
+         // The total is gathered here, so only carriers are visited later
+         double total = 0.0;
 
-      Impute(major, observed, extra, haplotypes, freqs, i);
+         for (int j = 0; j < states; j++)
+            total += extra[j] = vector[j] * matrix[i][j];
+
+         ImputeCarriers(major, observed, extra, total, haplotypes, freqs, i);
+         }
+      else
+         {
+         for (int j = 0; j < states; j++)
+            extra[j] = vector[j] * matrix[i][j];
+
+         Impute(major, observed, extra, haplotypes, freqs, i);
+         }
 
       if (observed[i])
          Condition(vector, haplotypes, i, observed[i], E[i], freqs[observed[i]][i]);
@@ -163,20 +406,130 @@ void MarkovModel::Impute(char * major, char * observed, char ** haplotypes, floa
 
    if (observed[0])
       Condition(vector, haplotypes, 0, observed[0], E[0], freqs[observed[0]][0]);
-   Impute(major, observed, vector, haplotypes, freqs, 0);
+
+   if (carrierCount != NULL && carrierCount[0] >= 0)
+      {
+      double total = 0.0;
+
+      for (int j = 0; j < states; j++)
+         total += vector[j];
+
+      ImputeCarriers(major, observed, vector, total, haplotypes, freqs, 0);
+      }
+   else
+      Impute(major, observed, vector, haplotypes, freqs, 0);
 
    delete [] vector;
    delete [] extra;
    }
 
+void MarkovModel::RecomputeRows(char * observed, char ** haplotypes, float ** freqs, int last)
+   {
+   // Repeats the steps of WalkLeft() from the checkpoint starting the
+   // block, which was stored after conditioning
+   for (int i = last - last % checkpointInterval; i < last; i++)
+      {
+      Transpose(matrix[i], matrix[i+1], R[i]);
+      if (observed[i+1])
+         Condition(matrix[i+1], haplotypes, i + 1, observed[i+1], E[i+1], freqs[observed[i+1]][i+1]);
+      }
+   }
+
 void MarkovModel::Impute(char * major, char * observed, float * probs,
                          char ** haplotypes, float ** freqs, int position)
    {
    double P[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
 
+   if (minorFlags != NULL)
+      SumAlleles<true>(probs, haplotypes, position, P);
+   else
+      SumAlleles<false>(probs, haplotypes, position, P);
+
+   ImputePosition(major, observed, P, freqs, position);
+   }
+
+// Sums probs by the allele of each state. The general kernel gathers one
+// allele from each haplotype; with two alleles, the minor allele flags
+// are read in marker order instead. Both add up states in the same order
+// and in double, so their sums are identical.
+template <bool BIALLELIC>
+void MarkovModel::SumAlleles(float * probs, char ** haplotypes, int position, double * P)
+   {
+   if (!BIALLELIC)
+      {
+      for (int i = 0; i < states; i++)
+         P[haplotypes[i][position]] += probs[i];
+
+      return;
+      }
+
+   const char * flags = minorFlags[position];
+   double commonSum = 0.0, minorSum = 0.0;
+
+   // Each state adds zero to the sum it does not belong to
    for (int i = 0; i < states; i++)
-      P[haplotypes[i][position]] += probs[i];
+      {
+      double carried = probs[i] * flags[i];
+
+      minorSum += carried;
+      commonSum += probs[i] - carried;
+      }
+
+   P[commonAllele[position]] += commonSum;
+   P[minorAllele[position]] += minorSum;
+   }
+
+// As Condition(), for panels with two alleles per marker. Each state is
+// scaled exactly as in the general kernel, without the allele gather.
+template <bool BIALLELIC>
+void MarkovModel::ConditionStates(float * vector, char ** haplotypes, int position,
+                                  char observed, double pmatch, double prandom, int first, int last)
+   {
+   if (!BIALLELIC)
+      {
+      for (int i = first; i < last; i++)
+         if (haplotypes[i][position] == observed)
+            vector[i] *= pmatch;
+         else
+            vector[i] *= prandom;
+
+      return;
+      }
+
+   const char * flags = minorFlags[position];
+   double common = commonAllele[position] == observed ? pmatch : prandom;
+   double minor = minorAllele[position] == observed && commonAllele[position] != observed ? pmatch : prandom;
+
+   for (int i = first; i < last; i++)
+      vector[i] *= flags[i] ? minor : common;
+   }
+
+// As Impute(), at a marker with listed carriers, given the sum of probs.
+// At monomorphic markers no state is visited at all.
+void MarkovModel::ImputeCarriers(char * major, char * observed, float * probs, double total,
+                                 char ** haplotypes, float ** freqs, int position)
+   {
+   double P[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+
+   int * list = carriers + carrierStart[position];
+   int count = carrierCount[position];
+   double carried = 0.0;
 
+   for (int k = 0; k < count; k++)
+      {
+      P[haplotypes[list[k]][position]] += probs[list[k]];
+      carried += probs[list[k]];
+      }
+
+   P[commonAllele[position]] += total - carried;
+
+   ImputePosition(major, observed, P, freqs, position);
+   }
+
+// Stores imputed probabilities given the summed weight for each allele
+void MarkovModel::ImputePosition(char * major, char * observed, double * P,
+                                 float ** freqs, int position)
+   {
    double ptotal = P[1] + P[2] + P[3] + P[4];
    double pmajor = P[major[position]];
 
@@ -205,6 +558,699 @@ void MarkovModel::Impute(char * major, char * observed, float * probs,
    leaveOneOut[position] = pmajor / ptotal;
    }
 
+// Each thread handles an even aligned block of states, so that flips
+// (i^1) stay within the block and only the state sums are shared
+void MarkovModel::StateRange(int & first, int & last)
+   {
+   int thread = 0, threads = 1;
+#ifdef _OPENMP
+   thread = omp_get_thread_num();
+   threads = omp_get_num_threads();
+#endif
+
+   int pairs = (states + 1) / 2;
+
+   first = 2 * (int) ((double) pairs * thread / threads);
+   last = 2 * (int) ((double) pairs * (thread + 1) / threads);
+
+   if (last > states) last = states;
+   }
+
+// Per thread partial sums, in two alternating sets so that a single
+// barrier per marker is enough
+void MarkovModel::AllocatePartials()
+   {
+   if (partialThreads < stateThreads)
+      {
+      FREE_ARRAY(partials);
+
+      partials = new double [2 * stateThreads * PARTIAL_STRIDE];
+      partialThreads = stateThreads;
+      }
+   }
+
+double * MarkovModel::Partial(int set, int thread)
+   {
+   return partials + ((set & 1) * partialThreads + thread) * PARTIAL_STRIDE;
+   }
+
+double MarkovModel::SumPartials(int set, int item)
+   {
+   double sum = 0.0;
+   int threads = 1;
+#ifdef _OPENMP
+   threads = omp_get_num_threads();
+#endif
+
+   // Always in thread order, so all threads get identical sums
+   for (int t = 0; t < threads; t++)
+      sum += Partial(set, t)[item];
+
+   return sum;
+   }
+
+// Called by every thread in the team; mirrors WalkLeft()
+void MarkovModel::WalkLeftStates(char * observed, char ** haplotypes, float ** freqs)
+   {
+   int thread = 0, first, last;
+#ifdef _OPENMP
+   thread = omp_get_thread_num();
+#endif
+   StateRange(first, last);
+
+   for (int i = first; i < last; i++)
+      matrix[0][i] = 1.;
+
+   for (int i = 0; i < markers - 1; i++)
+      {
+      if (observed[i])
+         Condition(matrix[i], haplotypes, i, observed[i], E[i], freqs[observed[i]][i], first, last);
+
+      double * partial = Partial(i, thread);
+
+      partial[0] = 0.0;
+      for (int j = first; j < last; j++)
+         partial[0] += matrix[i][j];
+
+      #pragma omp barrier
+
+      Transpose(matrix[i], matrix[i+1], R[i], SumPartials(i, 0), first, last);
+      }
+
+   if (observed[markers - 1])
+      Condition(matrix[markers - 1], haplotypes, markers - 1, observed[markers - 1],
+                E[markers - 1], freqs[observed[markers - 1]][markers - 1], first, last);
+   }
+
+// Called by every thread in the team; mirrors Impute()
+void MarkovModel::ImputeStates(char * major, char * observed, char ** haplotypes, float ** freqs,
+                               float * vector, float * extra)
+   {
+   int thread = 0, first, last;
+#ifdef _OPENMP
+   thread = omp_get_thread_num();
+#endif
+   StateRange(first, last);
+
+   double P[5];
+   float * swap;
+
+   for (int i = first; i < last; i++)
+      vector[i] = 1.;
+
+   for (int i = markers - 1; i >= 0; i--)
+      {
+      double * partial = Partial(i, thread);
+
+      // Allele weights for this position, then the state sum for the
+      // transition to the previous one
+      for (int a = 0; a < 5; a++)
+         partial[a] = 0.0;
+
+      if (i > 0)
+         for (int j = first; j < last; j++)
+            partial[haplotypes[j][i]] += extra[j] = vector[j] * matrix[i][j];
+
+      if (observed[i])
+         Condition(vector, haplotypes, i, observed[i], E[i], freqs[observed[i]][i], first, last);
+
+      if (i == 0)
+         for (int j = first; j < last; j++)
+            partial[haplotypes[j][0]] += vector[j];
+
+      partial[5] = 0.0;
+      for (int j = first; j < last; j++)
+         partial[5] += vector[j];
+
+      #pragma omp barrier
+
+      if (thread == 0)
+         {
+         for (int a = 0; a < 5; a++)
+            P[a] = SumPartials(i, a);
+
+         ImputePosition(major, observed, P, freqs, i);
+         }
+
+      if (i == 0) break;
+
+      Transpose(vector, extra, R[i - 1], SumPartials(i, 5), first, last);
+
+      swap = vector; vector = extra; extra = swap;
+      }
+   }
+
+// Forward sweep in float, storing each row in reduced precision after
+// scaling it to sum to one. The posteriors only need the shape of each
+// row, so the scale factors are not kept.
+template <class Storage>
+void MarkovModel::WalkLeftNormalized(typename Storage::Type ** rows,
+                                     char * observed, char ** haplotypes, float ** freqs)
+   {
+   float * vector = new float [states + 1];
+   float * next = new float [states + 1];
+   float * swap;
+
+   vector[states] = next[states] = 0.0;
+
+   for (int i = 0; i < states; i++)
+      vector[i] = 1.0 / states;
+
+   for (int m = 0; m < markers; m++)
+      {
+      if (observed[m])
+         Condition(vector, haplotypes, m, observed[m], E[m], freqs[observed[m]][m]);
+
+      double sum = 0.0;
+      for (int i = 0; i < states; i++)
+         sum += vector[i];
+
+      float scale = 1.0 / sum;
+      typename Storage::Type * row = rows[m];
+
+      for (int i = 0; i < states; i++)
+         row[i] = Storage::Encode(vector[i] *= scale);
+
+      if (m < markers - 1)
+         {
+         Transpose(vector, next, R[m], 1.0, 0, states);
+
+         swap = vector; vector = next; next = swap;
+         }
+      }
+
+   delete [] vector;
+   delete [] next;
+   }
+
+// Backward sweep matching WalkLeftNormalized(). Backward messages are also
+// rescaled at each marker, which leaves the imputed ratios unchanged.
+template <class Storage>
+void MarkovModel::ImputeNormalized(typename Storage::Type ** rows,
+                                   char * major, char * observed, char ** haplotypes, float ** freqs)
+   {
+   float * vector = new float [states + 1];
+   float * extra = new float [states + 1];
+   float * swap;
+
+   vector[states] = extra[states] = 0.0;
+
+   for (int i = 0; i < states; i++)
+      vector[i] = 1.;
+
+   for (int m = markers - 1; m > 0; m--)
+      {
+      typename Storage::Type * row = rows[m];
+
+      for (int j = 0; j < states; j++)
+         extra[j] = vector[j] * Storage::Decode(row[j]);
+
+      Impute(major, observed, extra, haplotypes, freqs, m);
+
+      if (observed[m])
+         Condition(vector, haplotypes, m, observed[m], E[m], freqs[observed[m]][m]);
+
+      double sum = 0.0;
+      for (int j = 0; j < states; j++)
+         sum += vector[j];
+
+      float scale = 1.0 / sum;
+      for (int j = 0; j < states; j++)
+         vector[j] *= scale;
+
+      Transpose(vector, extra, R[m - 1], 1.0, 0, states);
+
+      swap = vector; vector = extra; extra = swap;
+      }
+
+   if (observed[0])
+      Condition(vector, haplotypes, 0, observed[0], E[0], freqs[observed[0]][0]);
+   Impute(major, observed, vector, haplotypes, freqs, 0);
+
+   delete [] vector;
+   delete [] extra;
+   }
+
+void MarkovModel::CountAlleles(char ** haplotypes)
+   {
+   if (countedHaplotypes == haplotypes) return;
+
+   for (int i = 0; i < 5 * markers; i++)
+      alleleCounts[i] = 0;
+
+   for (int i = 0; i < states; i++)
+      for (int m = 0; m < markers; m++)
+         alleleCounts[haplotypes[i][m] * markers + m]++;
+
+   countedHaplotypes = haplotypes;
+   }
+
+// Conditions a sparse vector on one marker and rescales it to sum to one,
+// then stops tracking the least likely pairs of states, or tracks every
+// state again once most of the mass is untracked. Pairs have values for
+// both states, with zero for the padding state.
+void MarkovModel::BeamUpdate(int * pairs, float * values, int & count, float & background,
+                             float * dense, char ** haplotypes, int position,
+                             char observed, double e, double freq)
+   {
+   int tracked = 0, trackedMatches = 0;
+   double moved = 0.0;
+
+   double pmatch = (1. - e) + e * freq + backgroundError;
+   double prandom = e * freq + backgroundError;
+
+   for (int k = 0; k < count; k++)
+      for (int h = 0; h < 2; h++)
+         {
+         int state = pairs[k] * 2 + h;
+
+         if (state >= states) continue;
+
+         tracked++;
+
+         if (observed == 0) continue;
+
+         if (haplotypes[state][position] == observed)
+            {
+            values[k * 2 + h] *= pmatch;
+            trackedMatches++;
+            }
+         else
+            values[k * 2 + h] *= prandom;
+         }
+
+   int untracked = states - tracked;
+
+   if (observed && untracked > 0)
+      {
+      int matches = alleleCounts[observed * markers + position] - trackedMatches;
+      double average = background * (matches * pmatch + (untracked - matches) * prandom) / untracked;
+
+      // Untracked states share one value, so the extra weight of those
+      // that match is spread over all of them
+      moved = matches * fabs(background * pmatch - average);
+      background = average;
+      }
+
+   double sum = background * untracked;
+   for (int k = 0; k < count * 2; k++)
+      sum += values[k];
+
+   float scale = 1.0 / sum;
+
+   for (int k = 0; k < count * 2; k++)
+      values[k] *= scale;
+   background *= scale;
+
+   beamError += moved * scale;
+
+   // Drop pairs below a threshold that keeps the total dropped within
+   // budget, without sorting
+   double mass = background * untracked;
+   double budget = (1.0 - beam) - mass;
+
+   if (budget > 0.0 && count > 1)
+      {
+      double threshold = budget / count, dropped = 0.0;
+      int kept = 0;
+
+      for (int k = 0; k < count; k++)
+         {
+         double pair = values[k * 2] + values[k * 2 + 1];
+
+         if (pair < threshold)
+            {
+            dropped += pair;
+            untracked += pairs[k] * 2 + 1 < states ? 2 : 1;
+            continue;
+            }
+
+         pairs[kept] = pairs[k];
+         values[kept * 2] = values[k * 2];
+         values[kept * 2 + 1] = values[k * 2 + 1];
+         kept++;
+         }
+
+      if (kept < count)
+         {
+         mass += dropped;
+         background = mass / untracked;
+         beamError += dropped;
+         count = kept;
+         }
+      }
+
+   // Fall back to dense vectors when the mass spreads out
+   if (mass > 1.0 - beam)
+      {
+      int pairCount = (states + 1) / 2;
+
+      for (int i = 0; i < states; i++)
+         dense[i] = background;
+      if (states & 1)
+         dense[states] = 0.0;
+
+      for (int k = 0; k < count; k++)
+         {
+         dense[pairs[k] * 2] = values[k * 2];
+         dense[pairs[k] * 2 + 1] = values[k * 2 + 1];
+         }
+
+      for (int k = 0; k < pairCount; k++)
+         {
+         pairs[k] = k;
+         values[k * 2] = dense[k * 2];
+         values[k * 2 + 1] = dense[k * 2 + 1];
+         }
+
+      count = pairCount;
+      background = 0.0;
+      }
+
+   beamTracked += count * 2;
+   }
+
+// As Transpose(), for a sparse vector that sums to one
+void MarkovModel::BeamTranspose(int * pairs, float * values, int count, float & background, double r)
+   {
+   if (r == 0) return;
+
+   double flipRate = r * empiricalFlipRate;
+   double uniform = r * (1.0 - empiricalFlipRate) / states;
+   double complement = 1. - r;
+
+   for (int k = 0; k < count; k++)
+      {
+      float first = values[k * 2], second = values[k * 2 + 1];
+
+      values[k * 2] = first * complement + second * flipRate + uniform;
+      if (pairs[k] * 2 + 1 < states)
+         values[k * 2 + 1] = second * complement + first * flipRate + uniform;
+      }
+
+   // Once every state is tracked, there is no background to update
+   if (count < (states + 1) / 2)
+      background = background * (complement + flipRate) + uniform;
+   }
+
+void MarkovModel::WalkLeftBeam(char * observed, char ** haplotypes, float ** freqs)
+   {
+   CountAlleles(haplotypes);
+
+   int pairCount = (states + 1) / 2;
+   int * pairs = new int [pairCount];
+   float * values = new float [pairCount * 2];
+   float * dense = new float [pairCount * 2];
+
+   // All states are tracked at the first marker
+   int count = pairCount;
+   float background = 0.0;
+
+   for (int k = 0; k < pairCount; k++)
+      pairs[k] = k;
+   for (int i = 0; i < pairCount * 2; i++)
+      values[i] = i < states ? 1.0 / states : 0.0;
+
+   beamError = beamTracked = 0.0;
+
+   beamStart[0] = 0;
+   for (int m = 0; m < markers; m++)
+      {
+      BeamUpdate(pairs, values, count, background, dense, haplotypes, m,
+                 observed[m], E[m], freqs[observed[m]][m]);
+
+      if (beamStart[m] + count > beamCapacity)
+         {
+         // Grow storage, assuming later markers look like earlier ones
+         int capacity = (beamStart[m] + count) * 2 + pairCount;
+         int * newPairs = new int [capacity];
+         float * newValues = new float [capacity * 2];
+
+         for (int i = 0; i < beamStart[m]; i++)
+            newPairs[i] = beamPairs[i];
+         for (int i = 0; i < beamStart[m] * 2; i++)
+            newValues[i] = beamValues[i];
+
+         FREE_ARRAY(beamPairs);
+         FREE_ARRAY(beamValues);
+
+         beamPairs = newPairs;
+         beamValues = newValues;
+         beamCapacity = capacity;
+         }
+
+      for (int k = 0; k < count; k++)
+         {
+         beamPairs[beamStart[m] + k] = pairs[k];
+         beamValues[(beamStart[m] + k) * 2] = values[k * 2];
+         beamValues[(beamStart[m] + k) * 2 + 1] = values[k * 2 + 1];
+         }
+
+      beamBackground[m] = background;
+      beamStart[m + 1] = beamStart[m] + count;
+
+      if (m < markers - 1)
+         BeamTranspose(pairs, values, count, background, R[m]);
+      }
+
+   delete [] pairs;
+   delete [] values;
+   delete [] dense;
+   }
+
+// Combines the backward message at each marker with the stored forward
+// row. Both are sparse, so the forward row is scattered into a dense
+// scratch vector, relative to its background, and cleared again after.
+void MarkovModel::ImputeBeam(char * major, char * observed, char ** haplotypes, float ** freqs)
+   {
+   int pairCount = (states + 1) / 2;
+   int * pairs = new int [pairCount];
+   float * values = new float [pairCount * 2];
+   float * dense = new float [pairCount * 2];
+   float * forward = new float [pairCount * 2];
+
+   int count = pairCount;
+   float background = 0.0;
+
+   for (int k = 0; k < pairCount; k++)
+      pairs[k] = k;
+   for (int i = 0; i < pairCount * 2; i++)
+      {
+      values[i] = i < states ? 1.0 / states : 0.0;
+      forward[i] = 0.0;
+      }
+
+   for (int m = markers - 1; m >= 0; m--)
+      {
+      double P[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+      double totals[5], tracked[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+
+      // At the first marker, the conditioned backward message already
+      // has the same shape as the posterior
+      if (m == 0)
+         BeamUpdate(pairs, values, count, background, dense, haplotypes, 0,
+                    observed[0], E[0], freqs[observed[0]][0]);
+
+      int first = beamStart[m], last = beamStart[m + 1];
+      float rowBackground = m == 0 ? 1.0 : beamBackground[m];
+
+      for (int a = 0; a < 5; a++)
+         totals[a] = rowBackground * alleleCounts[a * markers + m];
+
+      if (m > 0)
+         for (int k = first; k < last; k++)
+            for (int h = 0; h < 2; h++)
+               {
+               int state = beamPairs[k] * 2 + h;
+
+               if (state >= states) continue;
+
+               forward[state] = beamValues[k * 2 + h] - rowBackground;
+               totals[haplotypes[state][m]] += forward[state];
+               }
+
+      for (int k = 0; k < count; k++)
+         for (int h = 0; h < 2; h++)
+            {
+            int state = pairs[k] * 2 + h;
+
+            if (state >= states) continue;
+
+            int allele = haplotypes[state][m];
+            double alpha = rowBackground + forward[state];
+
+            P[allele] += alpha * values[k * 2 + h];
+            tracked[allele] += alpha;
+            }
+
+      for (int a = 0; a < 5; a++)
+         P[a] += background * (totals[a] - tracked[a]);
+
+      if (m > 0)
+         for (int k = first; k < last; k++)
+            {
+            forward[beamPairs[k] * 2] = 0.0;
+            forward[beamPairs[k] * 2 + 1] = 0.0;
+            }
+
+      ImputePosition(major, observed, P, freqs, m);
+
+      if (m > 0)
+         {
+         BeamUpdate(pairs, values, count, background, dense, haplotypes, m,
+                    observed[m], E[m], freqs[observed[m]][m]);
+         BeamTranspose(pairs, values, count, background, R[m - 1]);
+         }
+      }
+
+   // Tracked states were counted at each marker of both sweeps
+   beamStates = beamTracked / (markers * 2);
+
+   delete [] pairs;
+   delete [] values;
+   delete [] dense;
+   delete [] forward;
+   }
+
+// The forward and backward sweeps run at the same time, one per thread.
+// Each stores its messages for one half of the chromosome in matrix and
+// then continues through the other half, combining its running message
+// with the stored one. Results are identical to WalkLeft() and Impute().
+void MarkovModel::ForwardBackward(char * major, char * observed, char ** haplotypes, float ** freqs)
+   {
+   if (markers < 2 || precision != PRECISION_FLOAT || beam > 0.0 || checkpointInterval > 0)
+      {
+      WalkLeft(observed, haplotypes, freqs);
+      Impute(major, observed, haplotypes, freqs);
+      return;
+      }
+
+   // Forward messages are stored before the middle, backward ones after
+   int middle = markers / 2;
+
+   float * forward = new float [states + 1];
+   float * forwardExtra = new float [states + 1];
+   float * backward = new float [states + 1];
+   float * backwardExtra = new float [states + 1];
+
+   forward[states] = forwardExtra[states] = 0.0;
+   backward[states] = backwardExtra[states] = 0.0;
+
+   #pragma omp parallel num_threads(2)
+      {
+      #pragma omp sections
+         {
+         #pragma omp section
+            {
+            for (int i = 0; i < states; i++)
+               matrix[0][i] = 1.;
+
+            for (int m = 0; m < middle - 1; m++)
+               {
+               if (observed[m])
+                  Condition(matrix[m], haplotypes, m, observed[m], E[m], freqs[observed[m]][m]);
+               Transpose(matrix[m], matrix[m + 1], R[m]);
+               }
+
+            if (observed[middle - 1])
+               Condition(matrix[middle - 1], haplotypes, middle - 1, observed[middle - 1],
+                         E[middle - 1], freqs[observed[middle - 1]][middle - 1]);
+            }
+
+         #pragma omp section
+            {
+            float * swap;
+
+            for (int i = 0; i < states; i++)
+               backward[i] = 1.;
+
+            for (int m = markers - 1; m >= middle; m--)
+               {
+               for (int i = 0; i < states; i++)
+                  matrix[m][i] = backward[i];
+
+               if (observed[m])
+                  Condition(backward, haplotypes, m, observed[m], E[m], freqs[observed[m]][m]);
+               Transpose(backward, backwardExtra, R[m - 1]);
+
+               swap = backward; backward = backwardExtra; backwardExtra = swap;
+               }
+            }
+         }
+
+      #pragma omp sections
+         {
+         #pragma omp section
+            {
+            float * swap;
+            double P[5];
+
+            Transpose(matrix[middle - 1], forward, R[middle - 1]);
+
+            for (int m = middle; m < markers; m++)
+               {
+               if (observed[m])
+                  Condition(forward, haplotypes, m, observed[m], E[m], freqs[observed[m]][m]);
+
+               for (int a = 0; a < 5; a++)
+                  P[a] = 0.0;
+
+               for (int i = 0; i < states; i++)
+                  P[haplotypes[i][m]] += matrix[m][i] * forward[i];
+
+               ImputePosition(major, observed, P, freqs, m);
+
+               if (m == markers - 1) break;
+
+               Transpose(forward, forwardExtra, R[m]);
+
+               swap = forward; forward = forwardExtra; forwardExtra = swap;
+               }
+            }
+
+         #pragma omp section
+            {
+            float * swap;
+            double P[5];
+
+            for (int m = middle - 1; m > 0; m--)
+               {
+               for (int a = 0; a < 5; a++)
+                  P[a] = 0.0;
+
+               for (int i = 0; i < states; i++)
+                  P[haplotypes[i][m]] += backward[i] * matrix[m][i];
+
+               ImputePosition(major, observed, P, freqs, m);
+
+               if (observed[m])
+                  Condition(backward, haplotypes, m, observed[m], E[m], freqs[observed[m]][m]);
+               Transpose(backward, backwardExtra, R[m - 1]);
+
+               swap = backward; backward = backwardExtra; backwardExtra = swap;
+               }
+
+            // As in Impute(), the first marker uses the backward message alone
+            if (observed[0])
+               Condition(backward, haplotypes, 0, observed[0], E[0], freqs[observed[0]][0]);
+
+            for (int a = 0; a < 5; a++)
+               P[a] = 0.0;
+
+            for (int i = 0; i < states; i++)
+               P[haplotypes[i][0]] += backward[i];
+
+            ImputePosition(major, observed, P, freqs, 0);
+            }
+         }
+      }
+
+   delete [] forward;
+   delete [] forwardExtra;
+   delete [] backward;
+   delete [] backwardExtra;
+   }
+
 void MarkovModel::ClearImputedDose()
    {
    imputedDose.Zero();
@@ -344,8 +1390,12 @@ double MarkovModel::CountRecombinants(float * from, float * to, double r)
 void MarkovModel::CountExpected(char * observed, char ** haplotypes, float ** freq)
    {
    float * swap;
-   float * vector = new float [states];
-   float * extra = new float [states];
+   // Flips pair each state with its neighbour, so odd numbers of states
+   // need the same zero padding used for the forward matrix
+   float * vector = new float [states + 1];
+   float * extra = new float [states + 1];
+
+   vector[states] = extra[states] = 0.0;
 
    // Initialize likelihoods at first position
    for (int i = 0; i < states; i++)
@@ -354,6 +1404,8 @@ void MarkovModel::CountExpected(char * observed, char ** haplotypes, float ** fr
    // Scan along chromosome
    for (int i = markers - 1; i > 0; i--)
       {
+      scratchFile.ReadAhead(i);
+
       for (int j = 0; j < states; j++)
          extra[j] = vector[j] * matrix[i][j];
 
@@ -18,9 +18,15 @@
 #define __MARKOVMODEL_H__
 
 #include "MarkovParameters.h"
+#include "ReducedPrecision.h"
+#include "ScratchMatrix.h"
 #include "StringBasics.h"
 #include "MathVector.h"
 
+// Doubles between the partial sums of different threads, enough to keep
+// them on separate cache lines
+#define PARTIAL_STRIDE  8
+
 class MarkovModel : public MarkovParameters
    {
    public:
@@ -30,17 +36,77 @@ class MarkovModel : public MarkovParameters
       Vector   imputedDose, imputedHap, leaveOneOut;
       String   imputedAlleles;
 
+      // Threads sharing the state loops for a single haplotype
+      int      stateThreads;
+
+      // Format of the forward matrix, set before Allocate(). With reduced
+      // precision, rows are normalized to sum to one and stored in
+      // reduced instead of matrix. Only WalkLeft() and Impute() support
+      // reduced precision, and they then run on a single thread.
+      int      precision;
+      unsigned short ** reduced;
+
+      // Markers between stored rows of the forward matrix, set before
+      // Allocate(), or 0 to store every row. Impute() recomputes the rows
+      // between two checkpoints from the first of them as it reaches each
+      // block, so memory use falls to about 2 * sqrt(markers) rows when
+      // checkpoints are sqrt(markers) apart, at the cost of a second
+      // forward sweep. Only WalkLeft() and Impute() on a single thread
+      // support checkpoints.
+      int      checkpoint;
+
+      // Directory for a scratch file backing the full forward matrix, set
+      // before Allocate(), or empty to keep the matrix in memory. The
+      // serial WalkLeft(), Impute() and CountExpected() stream rows to and
+      // from the file; other sweeps use it as ordinary memory.
+      String   scratch;
+
+      // With beam > 0, WalkLeft() and Impute() only track the pairs of
+      // states needed to keep that fraction of the mass at each marker,
+      // and share the remainder evenly among the other states, tracking
+      // all states again whenever the shared part grows beyond 1 - beam.
+      // After Impute(), beamStates holds the states tracked per marker and
+      // beamError an estimate of the posterior mass misplaced, averaged
+      // and summed over both sweeps.
+      double   beam;
+      double   beamStates, beamError;
+
+      // Carrier lists from HaplotypeSet::ListCarriers() for the states,
+      // or NULL, with the allele of all other states in commonAllele.
+      // Where present, conditioning and imputation look up alleles for
+      // the listed states only.
+      int *    carrierCount;
+      int *    carrierStart;
+      int *    carriers;
+      char *   commonAllele;
+
+      // For panels where HaplotypeSet::ListMinorAlleles() finds only two
+      // alleles per marker, the second allele at each marker and flags
+      // for the states that carry it (see HaplotypeSet::ListMinorFlags()),
+      // with the first allele in commonAllele, or NULL. Conditioning and
+      // posterior sums then use kernels specialized for two alleles.
+      char *   minorAllele;
+      char **  minorFlags;
+
       MarkovModel();
       ~MarkovModel();
 
       void   Condition(float * vector, char ** haplotypes, int position,
                        char observed, double e, double freq);
 
+      void   Condition(float * vector, char ** haplotypes, int position,
+                       char observed, double e, double freq, int first, int last);
+
       void   Transpose(float * from, float * to, double r);
+      void   Transpose(float * from, float * to, double r, double sum, int first, int last);
 
       void   WalkLeft(char * observed, char ** haplotypes, float ** freqs);
       void   Impute(char * major, char * observed, char ** haplotypes, float ** freqs);
       void   Impute(char * major, char * observed, float * probs, char ** haplotypes, float ** freqs, int position);
+      void   ImputeCarriers(char * major, char * observed, float * probs, double total,
+                            char ** haplotypes, float ** freqs, int position);
+      void   ImputePosition(char * major, char * observed, double * P, float ** freqs, int position);
+      void   ForwardBackward(char * major, char * observed, char ** haplotypes, float ** freqs);
 
       void   Allocate(int markers, int states);
       void   FreeMemory();
@@ -53,6 +119,69 @@ class MarkovModel : public MarkovParameters
       double CountErrors(float * vector, char ** haplotypes, int position, char observed, double e, double freq);
       double CountRecombinants(float * from, float * to, double r);
       void   CountExpected(char * observed, char ** haplotypes, float ** freqs);
+
+   private:
+      // Times the forward sweep was scaled up to avoid underflow, counted
+      // by the thread updating the first state
+      int      rescales;
+
+      // Storage for checkpoints and the block between them, with matrix
+      // rows pointing into it, and the interval it was allocated for
+      float *  checkpointRows;
+      int      checkpointInterval;
+
+      ScratchMatrix scratchFile;
+
+      // Values of carriers while the other states are conditioned
+      float *  carrierValues;
+
+      // Sparse forward rows, as pairs of states and their values, with
+      // the value shared by the untracked states of each marker
+      int *    beamStart;
+      int *    beamPairs;
+      float *  beamValues;
+      float *  beamBackground;
+      int      beamCapacity;
+      double   beamTracked;
+
+      // Reference allele counts at each marker, for untracked states
+      int *    alleleCounts;
+      char **  countedHaplotypes;
+
+      double * partials;
+      int      partialThreads;
+
+      void     RecomputeRows(char * observed, char ** haplotypes, float ** freqs, int last);
+
+      void     StateRange(int & first, int & last);
+      void     AllocatePartials();
+      double * Partial(int set, int thread);
+      double   SumPartials(int set, int item);
+
+      void     WalkLeftStates(char * observed, char ** haplotypes, float ** freqs);
+      void     ImputeStates(char * major, char * observed, char ** haplotypes, float ** freqs,
+                            float * vector, float * extra);
+
+      template <bool BIALLELIC>
+      void     SumAlleles(float * probs, char ** haplotypes, int position, double * P);
+      template <bool BIALLELIC>
+      void     ConditionStates(float * vector, char ** haplotypes, int position, char observed,
+                               double pmatch, double prandom, int first, int last);
+
+      void     CountAlleles(char ** haplotypes);
+      void     BeamUpdate(int * pairs, float * values, int & count, float & background,
+                        float * dense, char ** haplotypes, int position,
+                        char observed, double e, double freq);
+      void     BeamTranspose(int * pairs, float * values, int count, float & background, double r);
+      void     WalkLeftBeam(char * observed, char ** haplotypes, float ** freqs);
+      void     ImputeBeam(char * major, char * observed, char ** haplotypes, float ** freqs);
+
+      template <class Storage>
+      void     WalkLeftNormalized(typename Storage::Type ** rows,
+                                  char * observed, char ** haplotypes, float ** freqs);
+      template <class Storage>
+      void     ImputeNormalized(typename Storage::Type ** rows,
+                                char * major, char * observed, char ** haplotypes, float ** freqs);
    };
 
 #endif
@@ -17,12 +17,21 @@
 #include "MarkovParameters.h"
 #include "InputFile.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+// Identifies binary parameter files, and changes with their layout
+#define BINARY_MAGIC    "MMPARAM1"
+
 MarkovParameters::MarkovParameters()
    {
    markers = 0;
    empiricalCount = 0;
    empiricalFlips = 0.0;
    empiricalFlipRate = 0.80;
+   empiricalLogLikelihood = logLikelihood = 0.0;
    }
 
 MarkovParameters::~MarkovParameters()
@@ -33,6 +42,7 @@ MarkovParameters & MarkovParameters::operator += (const MarkovParameters & rhs)
    {
    empiricalCount += rhs.empiricalCount;
    empiricalFlips += rhs.empiricalFlips;
+   empiricalLogLikelihood += rhs.empiricalLogLikelihood;
 
    for (int i = 0; i < markers - 1; i++)
       {
@@ -49,12 +59,14 @@ void MarkovParameters::CopyParameters(const MarkovParameters & rhs)
    markers = rhs.markers;
 
    empiricalFlipRate = rhs.empiricalFlipRate;
+   logLikelihood = rhs.logLikelihood;
 
    E = rhs.E;
    R = rhs.R;
 
    empiricalCount = 0;
    empiricalFlips = 0.0;
+   empiricalLogLikelihood = 0.0;
 
    empE.Dimension(markers);
    empE.Zero();
@@ -68,6 +80,7 @@ void MarkovParameters::Allocate(int MARKERS)
 
    empiricalCount = 0;
    empiricalFlips = 0.0;
+   empiricalLogLikelihood = 0.0;
 
    E.Dimension(markers);
    E.Zero();
@@ -145,11 +158,11 @@ bool MarkovParameters::ReadCrossoverRates(const char * filename)
    StringArray rec;
    rec.Read(filename);
 
-   // Load estimated per marker error rates
+   // Load estimated per interval crossover rates
    if (rec.Length() == markers)
       {
-      printf("  Updating error rates using data in %s ...\n", (const char *) filename);
-      for (int i = 0; i < markers; i++)
+      printf("  Updating recombination rates using data in %s ...\n", (const char *) filename);
+      for (int i = 0; i < markers - 1; i++)
          {
          tokens.ReplaceTokens(rec[i+1]);
 
@@ -162,6 +175,80 @@ bool MarkovParameters::ReadCrossoverRates(const char * filename)
    return false;
    }
 
+void MarkovParameters::WriteBinary(const char * filename)
+   {
+   // Written under a temporary name and then renamed, so that concurrent
+   // runs sharing a file never read a partial copy. The counter keeps the
+   // name unique between threads of one process, such as manifest jobs.
+   static int written = 0;
+   int serial;
+
+   #pragma omp atomic capture
+   serial = written++;
+
+   String temporary;
+   temporary.printf("%s.%d.%d.tmp", filename, (int) getpid(), serial);
+
+   FILE * f = fopen(temporary, "wb");
+
+   if (f == NULL)
+      {
+      printf("  WARNING -- Parameters could not be saved to %s\n", filename);
+      return;
+      }
+
+   bool ok = fwrite(BINARY_MAGIC, 1, 8, f) == 8 &&
+             fwrite(&markers, sizeof(int), 1, f) == 1 &&
+             fwrite(&empiricalFlipRate, sizeof(double), 1, f) == 1 &&
+             fwrite(R.data, sizeof(double), markers - 1, f) == (size_t) (markers - 1) &&
+             fwrite(E.data, sizeof(double), markers, f) == (size_t) markers;
+
+   if (fclose(f) != 0 || !ok || rename(temporary, filename) != 0)
+      {
+      printf("  WARNING -- Parameters could not be saved to %s\n", filename);
+      remove(temporary);
+      }
+   }
+
+bool MarkovParameters::ReadBinary(const char * filename)
+   {
+   FILE * f = fopen(filename, "rb");
+
+   if (f == NULL)
+      return false;
+
+   char magic[8];
+   int  count = 0;
+   double flipRate;
+
+   bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, BINARY_MAGIC, 8) == 0 &&
+             fread(&count, sizeof(int), 1, f) == 1 && count == markers &&
+             fread(&flipRate, sizeof(double), 1, f) == 1;
+
+   // Rates are only replaced once the whole file has been read
+   Vector rates, errors;
+
+   if (ok)
+      {
+      rates.Dimension(markers - 1);
+      errors.Dimension(markers);
+
+      ok = fread(rates.data, sizeof(double), markers - 1, f) == (size_t) (markers - 1) &&
+           fread(errors.data, sizeof(double), markers, f) == (size_t) markers;
+      }
+
+   fclose(f);
+
+   if (ok)
+      {
+      R = rates;
+      E = errors;
+      empiricalFlipRate = flipRate;
+      }
+
+   return ok;
+   }
+
 void MarkovParameters::UpdateModel()
    {
    double scale = 1.0 / empiricalCount;
@@ -189,6 +276,7 @@ void MarkovParameters::UpdateModel()
    backgroundE /= empiricalCount * backgroundEcount + 1e-30;
 
    empiricalFlipRate = empiricalFlips / (empR.Sum() + 1e-30);
+   logLikelihood = empiricalLogLikelihood * scale;
 
    for (int i = 0; i < markers - 1; i++)
       {
@@ -203,5 +291,51 @@ void MarkovParameters::UpdateModel()
 
    empiricalCount = 0;
    empiricalFlips = 0.0;
+   empiricalLogLikelihood = 0.0;
    }
 
+void MarkovParameters::UpdateModel(MarkovParameters & running, double step, int count)
+   {
+   double weight = step / (empiricalCount + 1e-30);
+
+   for (int i = 0; i < markers - 1; i++)
+      {
+      running.empR[i] = running.empR[i] * (1.0 - step) + empR[i] * weight;
+      empR[i] = running.empR[i] * count;
+      }
+
+   for (int i = 0; i < markers; i++)
+      {
+      running.empE[i] = running.empE[i] * (1.0 - step) + empE[i] * weight;
+      empE[i] = running.empE[i] * count;
+      }
+
+   running.empiricalFlips = running.empiricalFlips * (1.0 - step) + empiricalFlips * weight;
+   empiricalFlips = running.empiricalFlips * count;
+
+   // The likelihood is that of the latest batch alone
+   empiricalLogLikelihood *= (double) count / (empiricalCount + 1e-30);
+
+   // Thresholds in UpdateModel() then treat markers with few events in a
+   // round's worth of haplotypes as background, as in batch updates
+   empiricalCount = count;
+
+   UpdateModel();
+   }
+
+double MarkovParameters::RelativeChange(const MarkovParameters & previous)
+   {
+   // Estimates for single markers rest on few events and stay noisy, so
+   // convergence is judged on the expected totals along the chromosome
+   double crossovers = R.Sum(), previousCrossovers = previous.R.Sum();
+   double errors = E.Sum(), previousErrors = previous.E.Sum();
+
+   double change = fabs(crossovers - previousCrossovers) / (previousCrossovers + 1e-30);
+   double errorChange = fabs(errors - previousErrors) / (previousErrors + 1e-30);
+   double flipChange = fabs(empiricalFlipRate - previous.empiricalFlipRate);
+
+   if (errorChange > change) change = errorChange;
+   if (flipChange > change) change = flipChange;
+
+   return change;
+   }
@@ -30,6 +30,11 @@ class MarkovParameters
       Vector   R, empR;
       Vector   E, empE;
 
+      // Sum of the log likelihoods of haplotypes counted since the last
+      // update, and their mean as of the last UpdateModel()
+      double   empiricalLogLikelihood;
+      double   logLikelihood;
+
       MarkovParameters();
       ~MarkovParameters();
 
@@ -46,7 +51,22 @@ class MarkovParameters
       bool ReadErrorRates(const char * filename);
       bool ReadCrossoverRates(const char * filename);
 
+      // Compact binary copies of R, E and the flip rate; reading fails if
+      // the file is missing, truncated or for a different number of markers
+      void WriteBinary(const char * filename);
+      bool ReadBinary(const char * filename);
+
       void   UpdateModel();
+
+      // Blends the statistics counted since the last update into the per
+      // haplotype averages held in running, giving them weight step, then
+      // updates the model from the averages as if they had been counted
+      // on count haplotypes
+      void   UpdateModel(MarkovParameters & running, double step, int count);
+
+      // Largest relative change in expected crossovers or errors per
+      // haplotype, or change in the flip rate, since the previous parameters
+      double RelativeChange(const MarkovParameters & previous);
    };
 
 #endif
@@ -0,0 +1,235 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "MemoryPlanner.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#define MEGABYTE     1048576.0
+
+// Relative cost of imputation with each kind of storage, measured with
+// --metrics on a panel of 3,000 haplotypes. Checkpoints repeat most of
+// the forward sweep, reduced rows are packed and unpacked.
+static const double storageCost[] = { 1.0, 1.3, 1.2 };
+
+MemoryPlanner::MemoryPlanner()
+   {
+   markers = haplotypes = 0;
+   targetMarkers = targetHaplotypes = 0;
+   rounds = 5;
+   states = 200;
+   maxThreads = 1;
+   sparseSites = 0.0;
+
+   precision = PRECISION_BF16;
+   requiredPrecision = false;
+
+   scratch = false;
+   biallelic = false;
+   streamBatch = 0;
+   nsPerUpdate = 6.5;
+
+   threads = estimationThreads = 0;
+   storage = STORAGE_FULL;
+   checkpoint = batch = 0;
+   panelBytes = targetBytes = modelBytes = estimationBytes = 0.0;
+   imputationTotal = estimationTotal = 0.0;
+   throughput = 0.0;
+   budget = 0.0;
+   }
+
+const char * MemoryPlanner::StorageName(int storage)
+   {
+   switch (storage)
+      {
+      case STORAGE_FULL :         return "full";
+      case STORAGE_CHECKPOINTED : return "checkpointed";
+      case STORAGE_REDUCED :      return "reduced precision";
+      }
+
+   return "unknown";
+   }
+
+int MemoryPlanner::Checkpoint()
+   {
+   // Checkpoints plus one block are fewest when both hold sqrt(markers) rows
+   return (int) ceil(sqrt((double) markers));
+   }
+
+double MemoryPlanner::Cost(int storage)
+   {
+   return storageCost[storage];
+   }
+
+double MemoryPlanner::ModelBytes(int storage)
+   {
+   double width = haplotypes + (haplotypes & 1);
+   double rows = markers;
+
+   if (storage == STORAGE_CHECKPOINTED)
+      rows = (markers + Checkpoint() - 1) / Checkpoint() + Checkpoint();
+
+   double bytes = storage == STORAGE_REDUCED ? rows * haplotypes * 2.0 : rows * width * 4.0;
+
+   // Scratch files keep about two windows of 4 MB in memory
+   if (storage == STORAGE_FULL && scratch && bytes > 8.0 * MEGABYTE)
+      bytes = 8.0 * MEGABYTE;
+
+   // Imputed doses, haplotypes, leave one out estimates, the padded
+   // target haplotype and the working vectors of each sweep
+   return bytes + markers * 33.0 + width * 16.0;
+   }
+
+double MemoryPlanner::TargetBytes(int batch)
+   {
+   // Labels are counted generously, at 64 bytes per haplotype
+   double perHaplotype = targetMarkers + 64.0;
+
+   if (batch == 0 || batch >= targetHaplotypes)
+      return targetHaplotypes * perHaplotype;
+
+   // The first batch also feeds estimation and holds at least states
+   // haplotypes, and the next batch is read while the current one is imputed
+   int first = batch > states ? batch : states;
+   if (first > targetHaplotypes) first = targetHaplotypes;
+
+   return (first + batch) * perHaplotype;
+   }
+
+bool MemoryPlanner::Plan(double bytes)
+   {
+   budget = bytes;
+
+   // Alleles, flags for the second allele if requested, carrier lists,
+   // frequencies and per marker names, parameters and statistics
+   panelBytes = (double) markers * haplotypes * ((biallelic ? 2.0 : 1.0) + 4.0 * sparseSites) +
+                markers * 276.0;
+
+   double bestRate = 0.0;
+
+   for (int s = STORAGE_FULL; s <= STORAGE_REDUCED; s++)
+      {
+      if (requiredPrecision && s != STORAGE_REDUCED)
+         continue;
+
+      double model = ModelBytes(s);
+
+      // The first thread count that fits is the fastest with this storage
+      for (int t = maxThreads; t >= 1; t--)
+         {
+         double available = budget - panelBytes - t * model;
+
+         if (available <= 0.0)
+            continue;
+
+         int b = streamBatch;
+
+         if (b == 0 && TargetBytes(0) > available)
+            {
+            // Largest batches that fit, assuming batches of at least states
+            double perHaplotype = targetMarkers + 64.0;
+
+            b = (int) (available / (2.0 * perHaplotype));
+            if (b < states)
+               b = (int) (available / perHaplotype) - states;
+
+            // Each thread should have an individual or two to impute
+            if (b < 4 * t)
+               continue;
+            }
+
+         if (TargetBytes(b) > available)
+            continue;
+
+         double rate = t / Cost(s);
+
+         if (rate > bestRate)
+            {
+            bestRate = rate;
+            threads = t;
+            storage = s;
+            batch = b;
+            modelBytes = model;
+            }
+
+         break;
+         }
+      }
+
+   if (bestRate == 0.0)
+      return false;
+
+   checkpoint = storage == STORAGE_CHECKPOINTED ? Checkpoint() : 0;
+   targetBytes = TargetBytes(batch);
+   imputationTotal = panelBytes + targetBytes + threads * modelBytes;
+
+   // Estimation always stores the full matrix for every reference haplotype
+   estimationBytes = ModelBytes(STORAGE_FULL) + markers * 24.0;
+   estimationThreads = 0;
+
+   if (rounds > 0)
+      {
+      double available = budget - panelBytes - targetBytes;
+
+      estimationThreads = (int) (available / estimationBytes);
+
+      if (estimationThreads > maxThreads) estimationThreads = maxThreads;
+      if (estimationThreads < 1) estimationThreads = 1;
+
+      estimationTotal = panelBytes + targetBytes + estimationThreads * estimationBytes;
+      }
+
+   throughput = threads * 1e9 / (Cost(storage) * nsPerUpdate * markers * (double) haplotypes);
+
+   return true;
+   }
+
+void MemoryPlanner::Print()
+   {
+   printf("Memory Plan (budget of %.0f MB)\n", budget / MEGABYTE);
+   printf("  Reference panel      : %.1f MB\n", panelBytes / MEGABYTE);
+
+   if (batch == 0 || batch >= targetHaplotypes)
+      printf("  Target haplotypes    : %.1f MB for all %d haplotypes\n",
+             targetBytes / MEGABYTE, targetHaplotypes);
+   else
+      printf("  Target haplotypes    : %.1f MB, streamed in batches of %d\n",
+             targetBytes / MEGABYTE, batch);
+
+   if (storage == STORAGE_CHECKPOINTED)
+      printf("  Forward storage      : checkpointed every %d markers, %.1f MB per thread\n",
+             checkpoint, modelBytes / MEGABYTE);
+   else if (storage == STORAGE_FULL && scratch)
+      printf("  Forward storage      : full, in scratch files, %.1f MB per thread\n",
+             modelBytes / MEGABYTE);
+   else
+      printf("  Forward storage      : %s, %.1f MB per thread\n",
+             StorageName(storage), modelBytes / MEGABYTE);
+
+   printf("  Imputation           : %d thread%s, %.1f MB in total\n",
+          threads, threads == 1 ? "" : "s", imputationTotal / MEGABYTE);
+
+   if (rounds > 0)
+      printf("  Parameter estimation : %d thread%s, %.1f MB in total%s\n",
+             estimationThreads, estimationThreads == 1 ? "" : "s", estimationTotal / MEGABYTE,
+             estimationTotal > budget ? " (OVER BUDGET, consider --rounds 0)" : "");
+
+   printf("  Predicted throughput : %.1f haplotypes per second", throughput);
+   if (targetHaplotypes > 0)
+      printf(", about %.1f seconds for %d haplotypes", targetHaplotypes / throughput, targetHaplotypes);
+   printf("\n\n");
+   }
@@ -0,0 +1,83 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MEMORYPLANNER_H__
+#define __MEMORYPLANNER_H__
+
+#include "ReducedPrecision.h"
+
+// Ways of storing the forward matrix during imputation
+#define STORAGE_FULL          0
+#define STORAGE_CHECKPOINTED  1
+#define STORAGE_REDUCED       2
+
+// Chooses the number of threads, the size of target batches and the
+// storage of the forward matrix so that a run fits within a memory
+// budget, from the size of the reference panel and of the target set.
+// Estimates are upper bounds for the large arrays only, and predicted
+// throughput assumes the single thread speed in nsPerUpdate.
+class MemoryPlanner
+   {
+   public:
+      // Problem size and settings
+      int      markers, haplotypes;
+      int      targetMarkers, targetHaplotypes;
+      int      rounds, states;
+      int      maxThreads;
+      double   sparseSites;
+
+      // Format for reduced storage, and whether it was requested, in which
+      // case every plan uses it
+      int      precision;
+      bool     requiredPrecision;
+
+      // Whether full rows live in scratch files rather than memory
+      bool     scratch;
+
+      // Whether the panel keeps flags for the second allele (--biallelic)
+      bool     biallelic;
+
+      // Target batch size requested, or 0 to let the planner choose
+      int      streamBatch;
+
+      // Nanoseconds per state and marker for each thread with full storage
+      double   nsPerUpdate;
+
+      // The plan
+      int      threads, estimationThreads;
+      int      storage, checkpoint, batch;
+      double   panelBytes, targetBytes, modelBytes, estimationBytes;
+      double   imputationTotal, estimationTotal;
+      double   throughput;
+
+      MemoryPlanner();
+
+      // Returns false if imputation cannot fit in the budget
+      bool     Plan(double budget);
+      void     Print();
+
+      static const char * StorageName(int storage);
+
+   private:
+      double   budget;
+
+      int      Checkpoint();
+      double   ModelBytes(int storage);
+      double   Cost(int storage);
+      double   TargetBytes(int batch);
+   };
+
+#endif
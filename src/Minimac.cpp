@@ -0,0 +1,1128 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Minimac.h"
+#include "HaplotypeClipper.h"
+#include "Error.h"
+#include "MemoryAllocators.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define square(x)    ((x)*(x))
+
+ImputationBuffers::ImputationBuffers(float * hapDoses, float * dosages, int markerCount)
+   {
+   haplotypeDoses = hapDoses;
+   doses = dosages;
+   markers = markerCount;
+   }
+
+void ImputationBuffers::Haplotype(const char * label, int haplotype, int copy,
+                                  MarkovModel & model, const char * observed)
+   {
+   if (haplotypeDoses == NULL) return;
+
+   float * row = haplotypeDoses + (size_t) haplotype * markers;
+
+   for (int j = 0; j < markers; j++)
+      row[j] = model.imputedHap[j];
+   }
+
+void ImputationBuffers::Individual(const char * label, int individual, MarkovModel & model)
+   {
+   if (doses == NULL) return;
+
+   float * row = doses + (size_t) individual * markers;
+
+   for (int j = 0; j < markers; j++)
+      row[j] = model.imputedDose[j];
+   }
+
+Minimac::Minimac()
+   {
+   rounds = 5;
+   states = 200;
+   em = false;
+   numa = meetInMiddle = forceStateParallel = false;
+   precision = PRECISION_FLOAT;
+   checkpoint = 0;
+   tolerance = 0.0;
+   miniBatch = 0;
+   thin = 0.0;
+   window = 0;
+   overlap = 100;
+   quiet = false;
+   onlineBatches = referenceOffset = targetOffset = 0;
+   beam = 0.0;
+   sparseSites = 0.0;
+   biallelic = false;
+   prepared = false;
+   }
+
+Minimac::~Minimac()
+   {
+   }
+
+void Minimac::CopySettings(const Minimac & source)
+   {
+   rounds = source.rounds;
+   states = source.states;
+   em = source.em;
+   tolerance = source.tolerance;
+   miniBatch = source.miniBatch;
+   thin = source.thin;
+   cache = source.cache;
+   window = source.window;
+   overlap = source.overlap;
+   numa = source.numa;
+   meetInMiddle = source.meetInMiddle;
+   forceStateParallel = source.forceStateParallel;
+   precision = source.precision;
+   checkpoint = source.checkpoint;
+   scratch = source.scratch;
+   beam = source.beam;
+   sparseSites = source.sparseSites;
+   biallelic = source.biallelic;
+   quiet = source.quiet;
+   }
+
+void Minimac::LoadReference(const char * haplotypes, const char * snps)
+   {
+   // Read marker list
+   metrics.BeginPhase("ReferenceMarkers");
+   printf("Reading Reference Marker List ...\n");
+
+   markerNames.Read(snps);
+
+   // Index markers
+   for (int i = 0; i < markerNames.Length(); i++)
+      markerHash.Add(markerNames[i].Trim(), i);
+
+   printf("  %d Markers in Reference Haplotypes...\n\n", markerNames.Length());
+   metrics.EndPhase();
+
+   // Load reference haplotypes
+   metrics.BeginPhase("ReferenceHaplotypes");
+   printf("Loading reference haplotypes ...\n");
+
+   reference.markerCount = markerNames.Length();
+   reference.LoadHaplotypes(haplotypes);
+
+   printf("  %d Reference Haplotypes Loaded ...\n\n", reference.count);
+   metrics.EndPhase(reference.count);
+   }
+
+void Minimac::SetReference(char ** haplotypes, int count, const StringArray & names)
+   {
+   markerNames = names;
+
+   for (int i = 0; i < markerNames.Length(); i++)
+      markerHash.Add(markerNames[i].Trim(), i);
+
+   reference.markerCount = markerNames.Length();
+   reference.UseHaplotypes(haplotypes, count);
+   }
+
+int Minimac::MapMarkers(StringArray & targetMarkers, IntArray & markerIndex,
+                        String & firstMarker, String & lastMarker)
+   {
+   ClipReference(reference, markerNames, markerHash, targetMarkers,
+                 firstMarker, lastMarker);
+
+   // Crossref Marker Names to Reference Panel Positions
+   markerIndex.Dimension(targetMarkers.Length());
+
+   int matches = 0;
+
+   for (int i = 0; i < targetMarkers.Length(); i++)
+      {
+      markerIndex[i] = markerHash.Integer(targetMarkers[i].Trim());
+
+      if (markerIndex[i] >= 0) matches++;
+      }
+
+   printf("  %d Markers in Framework Haplotypes Overlap Reference ...\n", matches);
+
+   if (matches == 0)
+      error("No markers overlap between target and reference\n"
+            "Please check correct reference is being used and markers are named consistently");
+
+   printf("  %d Other Markers in Framework Haplotypes Discarded ...\n\n", targetMarkers.Length() - matches);
+
+   // Check for flips in reference vs. target haplotypes
+   int flips = 0;
+   int previous = -1;
+   for (int i = 0; i < markerIndex.Length(); i++)
+      if (markerIndex[i] >= 0)
+         if (markerIndex[i] < previous)
+            {
+            if (flips++ < 10)
+               printf("  -> Marker %s precedes %s in reference, but follows it in target\n",
+                     (const char *) markerNames[previous],
+                     (const char *) targetMarkers[i]);
+            previous = markerIndex[i];
+            }
+   if (flips > 10)
+      printf("  -> %d Additional Marker Order Changes Not Listed\n", flips - 10);
+   if (flips)
+      printf("  %d Marker Pairs Change Order in Target vs Framework Haplotypes\n", flips);
+
+   return matches;
+   }
+
+// Allele frequencies and major alleles, needed by every model
+void Minimac::PrepareReference()
+   {
+   if (prepared) return;
+
+   reference.CalculateFrequencies();
+   reference.ListMajorAlleles();
+
+   if (sparseSites > 0.0)
+      reference.ListCarriers(sparseSites);
+
+   prepared = true;
+   }
+
+// Minor allele flags, needed only by models that impute, so that models
+// fitted within windows or on a grid never build them
+void Minimac::PrepareImputation()
+   {
+   PrepareReference();
+
+   // Two allele kernels are chosen once for the whole run, if requested
+   if (!biallelic || reference.minor != NULL) return;
+
+   // Flags may be borrowed from a larger panel
+   if (reference.ListMinorAlleles() && reference.minorFlags == NULL)
+      reference.ListMinorFlags();
+   }
+
+void Minimac::CheckFrequencies(HaplotypeSet & target, IntArray & markerIndex,
+                               StringArray & targetMarkers)
+   {
+   metrics.BeginPhase("FrequencyQC");
+   PrepareReference();
+   target.CalculateFrequencies();
+   if (target.count)
+      target.CompareFrequencies(reference, markerIndex, targetMarkers);
+   metrics.EndPhase();
+   }
+
+void Minimac::InitializeParameters(const char * recombinationRates, const char * errorRates)
+   {
+   PrepareReference();
+
+   printf("Setting up Markov Model...\n\n");
+
+   if (numa)
+      replicas.Replicate(reference);
+
+   // Setup Markov Model
+   parameters.Allocate(reference.markerCount);
+
+   if (rounds > 0)
+      printf("Initializing Model Parameters (using %s and up to %d haplotypes)\n",
+             em ? "E-M" : "MCMC", states);
+
+   // Simple initial estimates of error and recombination rate
+   for (int i = 0; i < reference.markerCount; i++)
+      parameters.E[i] = 0.01;
+
+   for (int i = 0; i < reference.markerCount - 1; i++)
+      parameters.R[i] = 0.001;
+
+   if (errorRates != NULL && parameters.ReadErrorRates(errorRates))
+      printf("  Updated error rates using data in %s ...\n", errorRates);
+
+   if (recombinationRates != NULL && parameters.ReadCrossoverRates(recombinationRates))
+      printf("  Updated recombination rates using %s ...\n", recombinationRates);
+   }
+
+// 64-bit FNV-1a, taking eight bytes at a time where it can. Products only
+// carry upwards, so high bits are folded down after each word.
+static void HashBytes(unsigned long long & hash, const void * data, size_t bytes)
+   {
+   const unsigned long long prime = 1099511628211ULL;
+   const unsigned char * p = (const unsigned char *) data;
+
+   for ( ; bytes >= 8; bytes -= 8, p += 8)
+      {
+      unsigned long long word;
+      memcpy(&word, p, 8);
+      hash = (hash ^ word) * prime;
+      hash ^= hash >> 29;
+      }
+
+   for ( ; bytes > 0; bytes--, p++)
+      hash = (hash ^ *p) * prime;
+   }
+
+String Minimac::CacheFile(IntArray & markerIndex)
+   {
+   unsigned long long hash = 14695981039346656037ULL;
+
+   // Panel markers and content
+   HashBytes(hash, &reference.markerCount, sizeof(int));
+   for (int i = 0; i < markerNames.Length(); i++)
+      HashBytes(hash, (const char *) markerNames[i], markerNames[i].Length() + 1);
+
+   HashBytes(hash, &reference.count, sizeof(int));
+   for (int i = 0; i < reference.count; i++)
+      HashBytes(hash, reference.haplotypes[i], reference.markerCount);
+
+   // Target markers, as the panel markers they match
+   int targetMarkers = markerIndex.Length();
+   HashBytes(hash, &targetMarkers, sizeof(int));
+   for (int j = 0; j < targetMarkers; j++)
+      HashBytes(hash, &markerIndex[j], sizeof(int));
+
+   // Settings and starting parameters that change the fit
+   int settings[6] = { rounds, states, em ? 1 : 0, miniBatch, window, overlap };
+   double fractions[2] = { tolerance, thin };
+
+   HashBytes(hash, settings, sizeof(settings));
+   HashBytes(hash, fractions, sizeof(fractions));
+   HashBytes(hash, &parameters.empiricalFlipRate, sizeof(double));
+   HashBytes(hash, parameters.R.data, sizeof(double) * (reference.markerCount - 1));
+   HashBytes(hash, parameters.E.data, sizeof(double) * reference.markerCount);
+
+   String filename;
+   filename.printf("%s/%016llx.par", (const char *) cache, hash);
+
+   return filename;
+   }
+
+void Minimac::EstimateParameters(HaplotypeSet & target, IntArray & markerIndex)
+   {
+   String cached;
+
+   if (!cache.IsEmpty() && rounds > 0)
+      {
+      cached = CacheFile(markerIndex);
+
+      // Only the first rank looks, so that every rank takes the same path
+      // even while another run is writing the file
+      double found = cluster.rank == 0 && parameters.ReadBinary(cached);
+      cluster.Broadcast(found);
+
+      if (found)
+         {
+         cluster.Broadcast(parameters);
+         printf("  Reusing parameters cached in %s ...\n\n", (const char *) cached);
+         return;
+         }
+      }
+
+   if (window > 0 && rounds > 0 && reference.markerCount > window)
+      EstimateInWindows(target, markerIndex);
+   else if (thin > 0.0 && rounds > 0)
+      EstimateOnGrid(target, markerIndex);
+   else
+      RefineParameters(target, markerIndex);
+
+   if (!cached.IsEmpty() && cluster.rank == 0)
+      {
+      printf("  Caching estimated parameters in %s ...\n", (const char *) cached);
+      parameters.WriteBinary(cached);
+      }
+   }
+
+// Parses positions from marker names of the form [chr]:position, which
+// must not decrease along the panel
+static bool MarkerPositions(StringArray & names, Vector & positions)
+   {
+   positions.Dimension(names.Length());
+
+   for (int i = 0; i < names.Length(); i++)
+      {
+      const char * colon = strrchr((const char *) names[i], ':');
+      char * end;
+
+      if (colon == NULL)
+         return false;
+
+      positions[i] = strtod(colon + 1, &end);
+
+      if (end == colon + 1 || (i && positions[i] < positions[i - 1]))
+         return false;
+      }
+
+   return true;
+   }
+
+// Crossover probability over part of an interval with probability r
+static double SplitRate(double r, double fraction)
+   {
+   return 1.0 - pow(1.0 - r, fraction);
+   }
+
+// Minor allele frequency bins used to model error rates at dropped markers
+#define GRID_BINS    5
+
+static int FrequencyBin(double maf)
+   {
+   static const double edges[GRID_BINS - 1] = { 0.001, 0.005, 0.01, 0.05 };
+
+   int bin = 0;
+   while (bin < GRID_BINS - 1 && maf >= edges[bin])
+      bin++;
+
+   return bin;
+   }
+
+void Minimac::EstimateOnGrid(HaplotypeSet & target, IntArray & markerIndex)
+   {
+   PrepareReference();
+
+   int markers = reference.markerCount;
+
+   // Typed markers and common variants make up the grid
+   IntArray typed(markers);
+   typed.Zero();
+   for (int j = 0; j < markerIndex.Length(); j++)
+      if (markerIndex[j] >= 0)
+         typed[markerIndex[j]] = 1;
+
+   Vector maf;
+   IntArray grid, gridPosition(markers);
+
+   maf.Dimension(markers);
+
+   for (int i = 0; i < markers; i++)
+      {
+      double top = 0.0;
+      for (int a = 1; a <= 4; a++)
+         if (reference.freq[a][i] > top)
+            top = reference.freq[a][i];
+
+      maf[i] = 1.0 - top;
+      gridPosition[i] = -1;
+
+      if (typed[i] || maf[i] >= thin)
+         {
+         gridPosition[i] = grid.Length();
+         grid.Push(i);
+         }
+      }
+
+   if (grid.Length() < 2 || grid.Length() == markers)
+      {
+      RefineParameters(target, markerIndex);
+      return;
+      }
+
+   if (!quiet)
+      printf("  Estimating on %d of %d markers, typed or with minor allele frequency of at least %g ...\n",
+             grid.Length(), markers, thin);
+
+   // Crossovers are spread over physical distance where marker names give
+   // positions, otherwise in proportion to the starting rates
+   Vector distance, positions;
+   bool physical = MarkerPositions(markerNames, positions);
+
+   distance.Dimension(markers - 1);
+
+   for (int i = 0; i < markers - 1; i++)
+      distance[i] = physical ? positions[i + 1] - positions[i] : parameters.R[i];
+
+   // Thinned panel, with starting parameters carried over
+   char ** haplotypes = AllocateCharMatrix(reference.count, grid.Length());
+   for (int h = 0; h < reference.count; h++)
+      for (int g = 0; g < grid.Length(); g++)
+         haplotypes[h][g] = reference.haplotypes[h][grid[g]];
+
+   StringArray names;
+   for (int g = 0; g < grid.Length(); g++)
+      names.Push(markerNames[grid[g]]);
+
+   IntArray gridIndex(markerIndex.Length());
+   for (int j = 0; j < markerIndex.Length(); j++)
+      gridIndex[j] = markerIndex[j] >= 0 ? gridPosition[markerIndex[j]] : -1;
+
+   Minimac coarse;
+
+   coarse.rounds = rounds;
+   coarse.states = states;
+   coarse.em = em;
+   coarse.tolerance = tolerance;
+   coarse.miniBatch = miniBatch;
+   coarse.sparseSites = sparseSites;
+   coarse.quiet = quiet;
+   coarse.cluster = cluster;
+
+   coarse.SetReference(haplotypes, reference.count, names);
+   coarse.PrepareReference();
+   coarse.parameters.Allocate(grid.Length());
+   coarse.parameters.empiricalFlipRate = parameters.empiricalFlipRate;
+
+   for (int g = 0; g < grid.Length(); g++)
+      {
+      coarse.parameters.E[g] = parameters.E[grid[g]];
+
+      if (g + 1 == grid.Length()) break;
+
+      double stay = 1.0;
+      for (int i = grid[g]; i < grid[g + 1]; i++)
+         stay *= 1.0 - parameters.R[i];
+
+      coarse.parameters.R[g] = 1.0 - stay;
+      }
+
+   metrics.BeginPhase("GridEstimation");
+   coarse.RefineParameters(target, gridIndex);
+   metrics.EndPhase();
+
+   // Crossovers between grid markers are split by distance, and markers
+   // beyond either end of the grid use the rate of the nearest interval
+   for (int g = 0; g < grid.Length() - 1; g++)
+      {
+      int first = g == 0 ? 0 : grid[g];
+      int last = g == grid.Length() - 2 ? markers - 1 : grid[g + 1];
+
+      double span = 0.0;
+      for (int i = grid[g]; i < grid[g + 1]; i++)
+         span += distance[i];
+
+      for (int i = first; i < last; i++)
+         parameters.R[i] = span > 0.0 ?
+            SplitRate(coarse.parameters.R[g], distance[i] / span) :
+            SplitRate(coarse.parameters.R[g], 1.0 / (grid[g + 1] - grid[g]));
+      }
+
+   // Dropped markers take the mean error rate of grid markers with similar
+   // frequencies, or of all grid markers where there are none
+   double binSum[GRID_BINS], allSum = 0.0;
+   int    binCount[GRID_BINS];
+
+   for (int b = 0; b < GRID_BINS; b++)
+      binSum[b] = binCount[b] = 0;
+
+   for (int g = 0; g < grid.Length(); g++)
+      {
+      int bin = FrequencyBin(maf[grid[g]]);
+
+      binSum[bin] += coarse.parameters.E[g];
+      binCount[bin]++;
+      allSum += coarse.parameters.E[g];
+      }
+
+   for (int i = 0; i < markers; i++)
+      if (gridPosition[i] >= 0)
+         parameters.E[i] = coarse.parameters.E[gridPosition[i]];
+      else
+         {
+         int bin = FrequencyBin(maf[i]);
+
+         parameters.E[i] = binCount[bin] ? binSum[bin] / binCount[bin] : allSum / grid.Length();
+         }
+
+   parameters.empiricalFlipRate = coarse.parameters.empiricalFlipRate;
+   parameters.logLikelihood = coarse.parameters.logLikelihood;
+
+   if (!quiet)
+      printf("  Parameters interpolated to all %d markers by %s\n\n",
+             markers, physical ? "physical distance" : "starting recombination rates");
+
+   FreeCharMatrix(haplotypes, reference.count);
+   }
+
+void Minimac::EstimateInWindows(HaplotypeSet & target, IntArray & markerIndex)
+   {
+   int markers = reference.markerCount;
+   int windows = (markers + window - 1) / window;
+
+   // Intervals at the edge of each core need a marker beyond it
+   int margin = overlap > 0 ? overlap : 1;
+
+   printf("  Estimating in %d windows of %d markers, overlapping by %d ...\n",
+          windows, window, margin);
+
+   metrics.BeginPhase("WindowEstimation");
+
+   // Cores are fitted into a separate copy, since the starting parameters
+   // in each window's margins must not change while other windows run.
+   // Every marker is then filled in from the one core that holds it.
+   MarkovParameters fitted;
+   fitted.CopyParameters(parameters);
+   fitted.R.Zero();
+   fitted.E.Zero();
+
+   double flips = 0.0, crossovers = 0.0, logLikelihood = 0.0;
+
+   int threads = 1;
+#ifdef _OPENMP
+   threads = omp_get_max_threads();
+#endif
+
+   // Windows taken by this rank
+   int local = cluster.rank < windows ? (windows - cluster.rank - 1) / cluster.ranks + 1 : 0;
+
+   // Each window is one task, estimated with all its rounds on one thread
+   // of one rank, and the cores of every rank are summed afterwards. With
+   // too few windows to go around, they take turns with every thread.
+   #pragma omp parallel for schedule(dynamic) if (local >= threads)
+   for (int w = cluster.rank; w < windows; w += cluster.ranks)
+      {
+      int coreStart = w * window;
+      int coreEnd = coreStart + window < markers ? coreStart + window : markers;
+      int start = coreStart > margin ? coreStart - margin : 0;
+      int end = coreEnd + margin < markers ? coreEnd + margin : markers;
+
+      // The window borrows columns of the panel, without copying them
+      char ** rows = new char * [reference.count];
+      for (int h = 0; h < reference.count; h++)
+         rows[h] = reference.haplotypes[h] + start;
+
+      StringArray names;
+      for (int i = start; i < end; i++)
+         names.Push(markerNames[i]);
+
+      IntArray windowIndex(markerIndex.Length());
+      for (int j = 0; j < markerIndex.Length(); j++)
+         windowIndex[j] = markerIndex[j] >= start && markerIndex[j] < end ? markerIndex[j] - start : -1;
+
+      Minimac part;
+
+      part.rounds = rounds;
+      part.states = states;
+      part.em = em;
+      part.tolerance = tolerance;
+      part.miniBatch = miniBatch;
+      part.thin = thin;
+      part.quiet = true;
+
+      part.SetReference(rows, reference.count, names);
+      part.PrepareReference();
+      part.parameters.Allocate(end - start);
+      part.parameters.empiricalFlipRate = parameters.empiricalFlipRate;
+
+      for (int i = start; i < end; i++)
+         {
+         part.parameters.E[i - start] = parameters.E[i];
+         if (i + 1 < end) part.parameters.R[i - start] = parameters.R[i];
+         }
+
+      part.EstimateParameters(target, windowIndex);
+
+      // Cores do not overlap, so threads write separate markers
+      double coreCrossovers = 0.0;
+
+      for (int i = coreStart; i < coreEnd; i++)
+         {
+         fitted.E[i] = part.parameters.E[i - start];
+
+         if (i + 1 < markers)
+            {
+            fitted.R[i] = part.parameters.R[i - start];
+            coreCrossovers += fitted.R[i];
+            }
+         }
+
+      #pragma omp critical
+         {
+         flips += part.parameters.empiricalFlipRate * coreCrossovers;
+         crossovers += coreCrossovers;
+         logLikelihood += part.parameters.logLikelihood * (coreEnd - coreStart) / (end - start);
+         }
+
+      delete [] rows;
+      }
+
+   cluster.Sum(fitted.R);
+   cluster.Sum(fitted.E);
+   cluster.Sum(flips);
+   cluster.Sum(crossovers);
+   cluster.Sum(logLikelihood);
+
+   metrics.EndPhase();
+
+   parameters.R = fitted.R;
+   parameters.E = fitted.E;
+   parameters.empiricalFlipRate = flips / (crossovers + 1e-30);
+   parameters.logLikelihood = logLikelihood;
+
+   printf("      %.0f mosaic crossovers expected per haplotype\n", crossovers);
+   printf("      %.1f%% of crossovers are due to reference flips\n", parameters.empiricalFlipRate * 100.);
+   printf("      %.2f log-likelihood per haplotype, from the window cores\n\n", logLikelihood);
+   }
+
+void Minimac::RefineParameters(HaplotypeSet & target, IntArray & markerIndex)
+   {
+   MarkovParameters previous;
+   bool withTargets = false;
+   int  phaseRounds = 0;
+
+   // Parameter estimation loop
+   for (int round = 0; round < rounds; round++)
+      {
+      if (!quiet)
+         printf("  Round %d of Parameter Refinement ...\n", round + 1);
+
+      String phase;
+      phase.printf("EstimationRound%d", round + 1);
+      metrics.BeginPhase(phase);
+
+      // Target haplotypes contribute in the second half of the rounds, or
+      // earlier once the reference alone has converged
+      if (!withTargets && round >= rounds / 2)
+         {
+         withTargets = true;
+         phaseRounds = 0;
+         }
+
+      int iterations = states < reference.count ? states : reference.count;
+      int targetIterations = states < target.count ? states : target.count;
+
+      if (!withTargets)
+         targetIterations = 0;
+
+      double sampled = iterations + targetIterations;
+      double updates = (double) iterations * (reference.count - 1) * reference.markerCount +
+                       (double) targetIterations * reference.count * reference.markerCount;
+
+      previous.CopyParameters(parameters);
+
+      EstimationRound(target, markerIndex, iterations, targetIterations);
+
+      if (miniBatch == 0)
+         parameters.UpdateModel();
+
+      metrics.EndPhase(sampled, updates);
+
+      double crossovers = 0;
+      for (int i = 0; i < reference.markerCount - 1; i++)
+         crossovers += parameters.R[i];
+
+      double errors = 0;
+      for (int i = 0; i < reference.markerCount; i++)
+         {
+         double heterozygosity = 1.0 - square(reference.freq[1][i])
+                                     - square(reference.freq[2][i])
+                                     - square(reference.freq[3][i])
+                                     - square(reference.freq[4][i]);
+
+         errors += parameters.E[i] * heterozygosity;
+         }
+      errors /= reference.markerCount + 1e-30;
+
+      double change = parameters.RelativeChange(previous);
+
+      if (!quiet)
+         {
+         printf("      %.0f mosaic crossovers expected per haplotype\n", crossovers);
+         printf("      %.1f%% of crossovers are due to reference flips\n", parameters.empiricalFlipRate * 100.);
+         printf("      %.3g errors in mosaic expected per marker\n", errors);
+         printf("      %.2f log-likelihood per haplotype, parameters changed by %.2f%%\n",
+                parameters.logLikelihood, change * 100.);
+         }
+
+      // Likelihoods are only comparable between rounds on the same haplotypes,
+      // and mini-batches move to different haplotypes every round
+      bool settled = phaseRounds++ > 0 && change < tolerance &&
+                     (miniBatch > 0 ||
+                      fabs(parameters.logLikelihood - previous.logLikelihood) <
+                      tolerance * fabs(previous.logLikelihood));
+
+      if (settled)
+         {
+         if (withTargets || target.count == 0)
+            {
+            if (!quiet)
+               printf("  Parameters converged after %d rounds\n", round + 1);
+            break;
+            }
+
+         if (!quiet)
+            printf("  Parameters converged on reference haplotypes, adding targets ...\n");
+
+         withTargets = true;
+         phaseRounds = 0;
+         }
+      }
+   }
+
+void Minimac::EstimationRound(HaplotypeSet & target, IntArray & markerIndex,
+                              int iterations, int targetIterations)
+   {
+   // Online E-M: statistics from each mini-batch are blended into running
+   // averages with a decaying step, and the model is updated after every
+   // batch. Batches mix reference and target haplotypes in proportion, and
+   // successive rounds carry on through each panel where the last stopped.
+   // Without mini-batches, the whole round is a single batch.
+   int total = iterations + targetIterations;
+   int batch = miniBatch > 0 ? miniBatch : total;
+   double logLikelihood = 0.0;
+
+   if (miniBatch > 0 && onlineStatistics.markers != reference.markerCount)
+      onlineStatistics.Allocate(reference.markerCount);
+
+   MarkovModel original;
+   original.CopyParameters(parameters);
+
+   // Reference leave one out (loo) and target haplotypes are scheduled
+   // together, so that threads never wait between the two sets. Each
+   // thread keeps its model across tasks and batches, and merges its
+   // statistics once per batch.
+   #pragma omp parallel
+      {
+      MarkovModel mm;
+      MarkovParameters local;
+
+      mm.scratch = scratch;
+
+      // Reference panel closest to this thread
+      char ** panelHaplotypes = replicas.Haplotypes(reference);
+      float ** panelFreq = replicas.Frequencies(reference);
+
+      char ** reference_loo = new char * [reference.count - 1];
+      char * padded = new char [reference.markerCount];
+
+      // Every thread steps through the same batches
+      for (int first = 0; first < total; first += batch)
+         {
+         int last = first + batch < total ? first + batch : total;
+
+         int references = (int) ((double) iterations * last / total) -
+                          (int) ((double) iterations * first / total);
+         int targets = (last - first) - references;
+
+         bool used = false;
+
+         local.Allocate(reference.markerCount);
+
+         // Models start each batch from the latest parameters
+         if (mm.states)
+            mm.CopyParameters(original);
+
+         // Each rank takes every ranks-th task, for its share of both sets
+         #pragma omp for schedule(dynamic) nowait
+         for (int task = cluster.rank; task < references + targets; task += cluster.ranks)
+            {
+            char * observed;
+            char ** panel;
+            int panelCount;
+
+            if (task < references)
+               {
+               int left = (referenceOffset + task) % reference.count;
+
+               // Reference leave one out (loo) panel
+               for (int in = 0, out = 0; in < reference.count; in++)
+                  if (in != left)
+                     reference_loo[out++] = panelHaplotypes[in];
+
+               observed = panelHaplotypes[left];
+               panel = reference_loo;
+               panelCount = reference.count - 1;
+               }
+            else
+               {
+               // Padded version of target haplotype, including missing sites
+               for (int k = 0; k < reference.markerCount; k++)
+                  padded[k] = 0;
+
+               for (int j = 0; j < target.markerCount; j++)
+                  if (markerIndex[j] >= 0)
+                     padded[markerIndex[j]] = target.haplotypes[(targetOffset + task - references) % target.count][j];
+
+               observed = padded;
+               panel = panelHaplotypes;
+               panelCount = reference.count;
+               }
+
+            // Models are only reallocated when switching between panels
+            if (mm.states != panelCount)
+               {
+               if (used) local += mm;
+
+               mm.Allocate(reference.markerCount, panelCount);
+               mm.CopyParameters(original);
+               }
+            used = true;
+
+            // Markers of each haplotype are counted once, with its forward sweep
+            TraceSpan walk(tracer, "WalkLeft");
+            counters.Start(PERF_ESTIMATION);
+            mm.WalkLeft(observed, panel, panelFreq);
+            counters.Stop(PERF_ESTIMATION, reference.markerCount);
+            walk.Stop();
+
+            if (em)
+               {
+               TraceSpan count(tracer, "CountExpected");
+               counters.Start(PERF_ESTIMATION);
+               mm.CountExpected(observed, panel, panelFreq);
+               counters.Stop(PERF_ESTIMATION);
+               }
+            else
+               {
+               TraceSpan wait(tracer, "WaitProfileModel");
+               #pragma omp critical
+               {
+               wait.Stop();
+               TraceSpan profile(tracer, "ProfileModel");
+               counters.Start(PERF_ESTIMATION);
+               mm.ProfileModel(observed, panel, panelFreq);
+               counters.Stop(PERF_ESTIMATION);
+               }
+               }
+            }
+
+         if (used) local += mm;
+
+         TraceSpan wait(tracer, "WaitMergeParameters");
+         #pragma omp critical
+            {
+            wait.Stop();
+            TraceSpan merge(tracer, "MergeParameters");
+            parameters += local;
+            }
+
+         if (miniBatch == 0) continue;
+
+         // The master thread, which alone may call on the cluster, updates
+         // the model while the others wait for the next batch
+         #pragma omp barrier
+         #pragma omp master
+            {
+            cluster.Sum(parameters);
+
+            referenceOffset = (referenceOffset + references) % reference.count;
+            if (target.count)
+               targetOffset = (targetOffset + targets) % target.count;
+
+            // Steps shrink as batch^-0.6, slowly enough to average out sampling
+            // noise but fast enough to forget the starting parameters
+            double step = pow(onlineBatches + 1.0, -0.6);
+            onlineBatches++;
+
+            parameters.UpdateModel(onlineStatistics, step, total);
+            logLikelihood += parameters.logLikelihood * (last - first);
+
+            original.CopyParameters(parameters);
+            }
+         #pragma omp barrier
+         }
+
+      delete [] reference_loo;
+      delete [] padded;
+      }
+
+   if (miniBatch > 0)
+      {
+      parameters.logLikelihood = logLikelihood / total;
+      return;
+      }
+
+   // Every rank updates its model from the statistics of all ranks, so
+   // their parameters stay identical
+   cluster.Sum(parameters);
+   }
+
+int Minimac::Impute(HaplotypeSet & target, IntArray & markerIndex, ImputationOutput & output,
+                    HaplotypeStream * stream, int batchSize)
+   {
+   PrepareImputation();
+
+   // When streaming, one thread loads the next batch of target haplotypes
+   // while the others start imputing the current one
+   HaplotypeSet   nextBatch;
+   HaplotypeSet * batch = &target, * next = &nextBatch;
+   int offset = 0, individualOffset = 0, imputed = 0;
+
+   if (stream == NULL) batchSize = 0;
+
+   ProgressMeter progress("haplotypes imputed",
+                          batchSize > 0 || cluster.Distributed() ? 0 : target.count);
+
+   while (batch->count)
+      {
+      HaplotypeSet & current = *batch;
+
+      // Each individual, with all of its haplotypes, is one task
+      IntArray individuals;
+      for (int i = 0; i < current.count; i++)
+         if (i == 0 || current.labels[i] != current.labels[i-1])
+            individuals.Push(i);
+
+      // Block of individuals imputed by this rank
+      int first, last;
+      cluster.Slice(individuals.Length(), first, last);
+
+      imputed += (last < individuals.Length() ? individuals[last] : current.count) -
+                 (first < individuals.Length() ? individuals[first] : current.count);
+
+      // With fewer individuals than threads, all threads share the state
+      // loops of one haplotype at a time instead, or two threads run its
+      // forward and backward sweeps together
+      int threads = 1;
+#ifdef _OPENMP
+      threads = omp_get_max_threads();
+#endif
+      // Reduced precision, checkpoints and sparse sweeps run on a single
+      // thread per haplotype
+      bool stateParallel = threads > 1 && precision == PRECISION_FLOAT && beam == 0.0 &&
+                           checkpoint == 0 &&
+                           (forceStateParallel || last - first < threads);
+
+      bool bothWays = stateParallel && meetInMiddle;
+
+      if (bothWays)
+         printf("  Running forward and backward sweeps for each haplotype together ...\n");
+      else if (stateParallel)
+         printf("  Sharing states for each haplotype across %d threads ...\n", threads);
+
+      // Threads that share states need every thread for each haplotype,
+      // so in that mode the next batch is read before imputing starts,
+      // without any overlap
+      #pragma omp parallel if (!stateParallel)
+      {
+      #pragma omp single nowait
+      if (batchSize > 0)
+         stream->ReadBatch(*next, batchSize);
+
+      // Models are reused by each thread across individuals
+      MarkovModel mm;
+
+      SetupModel(mm, stateParallel && !bothWays ? threads : 1);
+
+      // Impute each individual
+      #pragma omp for schedule(dynamic)
+      for (int task = first; task < last; task++)
+         progress.Update(ImputeIndividual(mm, current, individuals[task], markerIndex, output,
+                                          offset, individualOffset + task, bothWays));
+      }
+
+      offset += current.count;
+      individualOffset += individuals.Length();
+
+      if (batchSize == 0) break;
+
+      HaplotypeSet * swap = batch; batch = next; next = swap;
+      }
+
+   progress.Finish();
+
+   return imputed;
+   }
+
+void Minimac::SetupModel(MarkovModel & mm, int stateThreads)
+   {
+   mm.precision = precision;
+   mm.checkpoint = checkpoint;
+   mm.scratch = scratch;
+   mm.beam = beam;
+
+   // Carriers index the reference panel, which every replica shares
+   mm.carrierCount = reference.carrierCount;
+   mm.carrierStart = reference.carrierStart;
+   mm.carriers = reference.carriers;
+   mm.commonAllele = reference.major;
+   mm.minorAllele = reference.minorFlags != NULL ? reference.minor : NULL;
+   mm.minorFlags = reference.minorFlags;
+   mm.Allocate(reference.markerCount, reference.count);
+   mm.CopyParameters(parameters);
+   mm.stateThreads = stateThreads;
+   }
+
+int Minimac::ImputeIndividual(MarkovModel & mm, HaplotypeSet & haplotypes, int i,
+                              IntArray & markerIndex, ImputationOutput & output,
+                              int haplotypeOffset, int individual, bool bothWays)
+   {
+   TraceSpan span(tracer, "Individual");
+
+   mm.ClearImputedDose();
+
+   // Padded version of target haplotype, including missing sites
+   char * padded = new char [reference.markerCount];
+
+   for (int j = 0; j < reference.markerCount; j++)
+      padded[j] = 0;
+
+   // Reference panel closest to this thread. Threads sharing the states
+   // or sweeps of one haplotype span nodes, while replicas are chosen by
+   // the calling thread, so they read the original panel instead.
+   bool shared = mm.stateThreads > 1 || bothWays;
+   char ** panelHaplotypes = shared ? reference.haplotypes : replicas.Haplotypes(reference);
+   float ** panelFreq = shared ? reference.freq : replicas.Frequencies(reference);
+
+   int k = i;
+
+   do {
+      // Copy current haplotype into padded vector
+      for (int j = 0; j < haplotypes.markerCount; j++)
+         if (markerIndex[j] >= 0)
+            padded[markerIndex[j]] = haplotypes.haplotypes[k][j];
+
+      if (bothWays)
+         {
+         // Both sweeps at once, so counters for the calling thread
+         // are attributed to the forward pass
+         TraceSpan sweeps(tracer, "ForwardBackward");
+         counters.Start(PERF_FORWARD);
+         mm.ForwardBackward(reference.major, padded, panelHaplotypes, panelFreq);
+         counters.Stop(PERF_FORWARD, reference.markerCount);
+         }
+      else
+         {
+         TraceSpan walk(tracer, "WalkLeft");
+         counters.Start(PERF_FORWARD);
+         mm.WalkLeft(padded, panelHaplotypes, panelFreq);
+         counters.Stop(PERF_FORWARD, reference.markerCount);
+         walk.Stop();
+
+         TraceSpan impute(tracer, "Impute");
+         counters.Start(PERF_BACKWARD);
+         mm.Impute(reference.major, padded, panelHaplotypes, panelFreq);
+         counters.Stop(PERF_BACKWARD, reference.markerCount);
+         }
+
+      TraceSpan waitOutput(tracer, "WaitHaplotypeOutput");
+      #pragma omp critical
+         {
+         waitOutput.Stop();
+         TraceSpan write(tracer, "HaplotypeOutput");
+         counters.Start(PERF_OUTPUT);
+         output.Haplotype(haplotypes.labels[i], haplotypeOffset + k, k - i + 1, mm, padded);
+         counters.Stop(PERF_OUTPUT, reference.markerCount);
+         }
+
+      k++;
+   } while (k < haplotypes.count && haplotypes.labels[k] == haplotypes.labels[i]);
+
+   TraceSpan waitOutput(tracer, "WaitDoseOutput");
+   #pragma omp critical
+      {
+      waitOutput.Stop();
+      TraceSpan write(tracer, "DoseOutput");
+      counters.Start(PERF_OUTPUT);
+      output.Individual(haplotypes.labels[i], individual, mm);
+      counters.Stop(PERF_OUTPUT);
+      }
+
+   delete [] padded;
+
+   return k - i;
+   }
@@ -0,0 +1,202 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MINIMAC_H__
+#define __MINIMAC_H__
+
+#include "HaplotypeSet.h"
+#include "HaplotypeStream.h"
+#include "MarkovModel.h"
+#include "MarkovParameters.h"
+#include "RunMetrics.h"
+#include "TraceRecorder.h"
+#include "PerfCounters.h"
+#include "NumaReplicas.h"
+#include "Cluster.h"
+#include "StringArray.h"
+#include "StringHash.h"
+#include "IntArray.h"
+
+// Receives results as each haplotype and individual is imputed. Calls
+// are serialized, so implementations need no locking of their own, and
+// the model is only valid for the duration of each call.
+class ImputationOutput
+   {
+   public:
+      virtual ~ImputationOutput() { }
+
+      // The model holds imputedHap, imputedAlleles and leaveOneOut for the
+      // haplotype; observed holds its alleles at reference positions. Copy
+      // numbers count from 1 within each individual.
+      virtual void Haplotype(const char * label, int haplotype, int copy,
+                             MarkovModel & model, const char * observed) { }
+
+      // The model holds imputedDose summed over the individual's haplotypes
+      virtual void Individual(const char * label, int individual, MarkovModel & model) { }
+   };
+
+// Copies results into arrays owned by the caller, laid out one row of
+// reference markers per haplotype or individual. Either may be NULL.
+class ImputationBuffers : public ImputationOutput
+   {
+   public:
+      float *  haplotypeDoses;
+      float *  doses;
+      int      markers;
+
+      ImputationBuffers(float * haplotypeDoses, float * doses, int markers);
+
+      virtual void Haplotype(const char * label, int haplotype, int copy,
+                             MarkovModel & model, const char * observed);
+      virtual void Individual(const char * label, int individual, MarkovModel & model);
+   };
+
+// Reference setup, parameter estimation and imputation, usable without
+// any files. The minimac executable is a thin wrapper around this class.
+class Minimac
+   {
+   public:
+      // Settings, with the same defaults as the command line
+      int      rounds, states;
+      bool     em;
+
+      // Relative change in parameters and in the log-likelihood between
+      // rounds below which estimation stops early, or 0 to run every round.
+      // With miniBatch, only the change in parameters is tested.
+      double   tolerance;
+
+      // Haplotypes between updates of online E-M, or 0 to update the
+      // model once per round
+      int      miniBatch;
+
+      // Smallest minor allele frequency of untyped markers kept when
+      // parameters are estimated on a thinned grid of markers, then
+      // interpolated to all markers, or 0 to estimate on every marker
+      double   thin;
+
+      // Directory of fitted parameters, keyed by a hash of the panel, the
+      // target markers, the settings above and the starting parameters,
+      // or empty to always estimate. Target haplotypes are not part of
+      // the key, so runs on new samples typed on the same array reuse them.
+      String   cache;
+
+      // Markers in the core of each window when estimation is split into
+      // overlapping windows, fitted independently in parallel and joined
+      // at their cores, and markers shared with each neighbour, or 0 to
+      // estimate along the whole chromosome at once
+      int      window, overlap;
+
+      // Set for models fitted within windows, or for jobs estimated side
+      // by side, to leave out progress messages during estimation
+      bool     quiet;
+
+      bool     numa, meetInMiddle, forceStateParallel;
+
+      // Forward matrix storage during imputation, one of PRECISION_*
+      int      precision;
+
+      // Markers between stored forward rows during imputation, or 0 to
+      // store every row (see MarkovModel::checkpoint)
+      int      checkpoint;
+
+      // Directory for scratch files backing the forward matrix of each
+      // thread, or empty to keep it in memory
+      String   scratch;
+
+      // Fraction of the mass kept by sparse sweeps, or 0 for exact sweeps
+      double   beam;
+
+      // Largest minor allele frequency for markers imputed from lists of
+      // carriers, or 0 to impute every marker densely
+      double   sparseSites;
+
+      // Impute with kernels specialized for two alleles per marker, where
+      // the panel has no third allele or missing data. These read a flag
+      // per haplotype and marker, as much memory again as the panel.
+      bool     biallelic;
+
+      HaplotypeSet      reference;
+      StringArray       markerNames;
+      StringIntHash     markerHash;
+      MarkovParameters  parameters;
+
+      RunMetrics        metrics;
+      TraceRecorder     tracer;
+      PerfCounters      counters;
+      NumaReplicas      replicas;
+
+      // Ranks sharing estimation rounds and the imputed individuals, each
+      // with its own copy of the panel and of the target haplotypes
+      Cluster           cluster;
+
+      Minimac();
+      ~Minimac();
+
+      // Reference panel, from files or from caller buffers (not copied)
+      void  LoadReference(const char * haplotypes, const char * snps);
+      void  SetReference(char ** haplotypes, int count, const StringArray & names);
+
+      // Clips the reference to the span of the target markers, if
+      // requested, and maps target markers to reference positions
+      int   MapMarkers(StringArray & targetMarkers, IntArray & markerIndex,
+                       String & firstMarker, String & lastMarker);
+
+      void  CheckFrequencies(HaplotypeSet & target, IntArray & markerIndex,
+                             StringArray & targetMarkers);
+
+      // Model parameters; may also be set directly in parameters
+      void  InitializeParameters(const char * recombinationRates = NULL,
+                                 const char * errorRates = NULL);
+      void  EstimateParameters(HaplotypeSet & target, IntArray & markerIndex);
+
+      // Imputes target haplotypes, then any further batches in the stream.
+      // Each rank imputes its own block of individuals from every batch.
+      // Returns the number of haplotypes imputed by this rank.
+      int   Impute(HaplotypeSet & target, IntArray & markerIndex, ImputationOutput & output,
+                   HaplotypeStream * stream = NULL, int batchSize = 0);
+
+      // Pieces of Impute(), for callers that schedule the individuals of
+      // several runs on one pool of threads. PrepareImputation() readies
+      // the panel, once frequencies are checked and before threads start.
+      // SetupModel() readies a thread's model for this panel, which
+      // ImputeIndividual() then uses to impute the individual whose first
+      // haplotype is haplotypes[i], returning its number of haplotypes.
+      void  PrepareImputation();
+      void  SetupModel(MarkovModel & mm, int stateThreads = 1);
+      int   ImputeIndividual(MarkovModel & mm, HaplotypeSet & haplotypes, int i,
+                             IntArray & markerIndex, ImputationOutput & output,
+                             int haplotypeOffset, int individual, bool bothWays = false);
+
+      // Copies the settings above, but not the panel or parameters
+      void  CopySettings(const Minimac & source);
+
+   private:
+      bool  prepared;
+
+      void  PrepareReference();
+      // Running statistics for online E-M, and where its batches stopped
+      MarkovParameters onlineStatistics;
+      int   onlineBatches, referenceOffset, targetOffset;
+
+      String CacheFile(IntArray & markerIndex);
+      void  EstimateInWindows(HaplotypeSet & target, IntArray & markerIndex);
+      void  EstimateOnGrid(HaplotypeSet & target, IntArray & markerIndex);
+      void  RefineParameters(HaplotypeSet & target, IntArray & markerIndex);
+      void  EstimationRound(HaplotypeSet & target, IntArray & markerIndex,
+                            int iterations, int targetIterations);
+   };
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "NumaReplicas.h"
+#include "StringArray.h"
+#include "InputFile.h"
+#include "MemoryAllocators.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+NumaReplicas::NumaReplicas()
+   {
+   nodes = 0;
+   count = markers = 0;
+   threads = 0;
+   nodeCpus = NULL;
+   haplotypes = NULL;
+   freq = NULL;
+   }
+
+NumaReplicas::~NumaReplicas()
+   {
+   if (haplotypes != NULL)
+      {
+      for (int n = 0; n < nodes; n++)
+         {
+         FreeCharMatrix(haplotypes[n], count);
+         FreeFloatMatrix(freq[n], 5);
+         }
+
+      delete [] haplotypes;
+      delete [] freq;
+      }
+
+   if (nodeCpus != NULL) delete [] nodeCpus;
+   }
+
+int NumaReplicas::Thread()
+   {
+#ifdef _OPENMP
+   return omp_get_thread_num();
+#else
+   return 0;
+#endif
+   }
+
+// Lists the processors of each node, as reported by sysfs
+bool NumaReplicas::ReadTopology()
+   {
+   StringArray cpulists, ranges, bounds;
+
+   for (nodes = 0; ; nodes++)
+      {
+      String filename;
+      filename.printf("/sys/devices/system/node/node%d/cpulist", nodes);
+
+      IFILE input = ifopen(filename, "rb");
+      if (input == NULL) break;
+
+      String line;
+      line.ReadLine(input);
+      ifclose(input);
+
+      cpulists.Push(line.Trim());
+      }
+
+   if (nodes == 0) return false;
+
+   nodeCpus = new IntArray [nodes];
+
+   // Lists look like "0-15,32-47"
+   for (int n = 0; n < nodes; n++)
+      {
+      ranges.ReplaceTokens(cpulists[n], ",");
+
+      for (int r = 0; r < ranges.Length(); r++)
+         {
+         bounds.ReplaceTokens(ranges[r], "-");
+
+         if (bounds.Length() == 0) continue;
+
+         int first = bounds[0].AsInteger();
+         int last = bounds.Length() > 1 ? bounds[1].AsInteger() : first;
+
+         for (int cpu = first; cpu <= last; cpu++)
+            nodeCpus[n].Push(cpu);
+         }
+      }
+
+   // Nodes without processors (e.g. memory only) cannot host workers
+   int used = 0;
+   for (int n = 0; n < nodes; n++)
+      if (nodeCpus[n].Length())
+         nodeCpus[used++] = nodeCpus[n];
+   nodes = used;
+
+   return nodes > 0;
+   }
+
+// Threads are dealt out to nodes in turn, so that any team size
+// spreads evenly across sockets
+bool NumaReplicas::PinThread(int thread)
+   {
+   int node = thread % nodes;
+   int slot = thread / nodes;
+
+   threadNode[thread] = node;
+
+#ifdef __linux__
+   cpu_set_t mask;
+
+   CPU_ZERO(&mask);
+   CPU_SET(nodeCpus[node][slot % nodeCpus[node].Length()], &mask);
+
+   return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+#else
+   return false;
+#endif
+   }
+
+bool NumaReplicas::Replicate(HaplotypeSet & reference)
+   {
+   if (!ReadTopology())
+      {
+      printf("  NUMA topology not available, reference panel not replicated\n\n");
+      return false;
+      }
+
+   threads = 1;
+#ifdef _OPENMP
+   threads = omp_get_max_threads();
+#endif
+
+   // Copies and pinning only pay off when threads span several nodes,
+   // otherwise leave placement to the operating system (and any cpuset)
+   if (nodes < 2 || threads < 2)
+      {
+      printf("  Single NUMA node in use, reference panel not replicated\n\n");
+      return false;
+      }
+
+   threadNode.Dimension(threads);
+   threadNode.Zero();
+
+   count = reference.count;
+   markers = reference.markerCount;
+
+   haplotypes = new char ** [nodes];
+   freq = new float ** [nodes];
+
+   for (int n = 0; n < nodes; n++)
+      {
+      haplotypes[n] = NULL;
+      freq[n] = NULL;
+      }
+
+   int pinned = 0;
+
+   // Each node's copy is allocated and filled by a thread on that node,
+   // so that first touch places its pages in local memory
+   #pragma omp parallel reduction(+:pinned)
+      {
+      int thread = Thread();
+
+      if (PinThread(thread))
+         pinned++;
+
+      if (thread < nodes)
+         {
+         char ** copy = AllocateCharMatrix(count, markers);
+         float ** copyFreq = AllocateFloatMatrix(5, markers);
+
+         for (int i = 0; i < count; i++)
+            for (int j = 0; j < markers; j++)
+               copy[i][j] = reference.haplotypes[i][j];
+
+         for (int a = 0; a < 5; a++)
+            for (int j = 0; j < markers; j++)
+               copyFreq[a][j] = reference.freq[a][j];
+
+         haplotypes[thread] = copy;
+         freq[thread] = copyFreq;
+         }
+      }
+
+   // With fewer threads than nodes, some nodes have no workers
+   int copies = 0;
+   for (int n = 0; n < nodes; n++)
+      if (haplotypes[n] != NULL)
+         copies++;
+   nodes = copies;
+
+   printf("  Reference panel replicated on %d NUMA node%s, %d of %d threads pinned\n\n",
+          nodes, nodes == 1 ? "" : "s", pinned, threads);
+
+   return true;
+   }
+
+char ** NumaReplicas::Haplotypes(HaplotypeSet & reference)
+   {
+   if (haplotypes == NULL) return reference.haplotypes;
+
+   int thread = Thread();
+
+   return thread < threads ? haplotypes[threadNode[thread]] : reference.haplotypes;
+   }
+
+float ** NumaReplicas::Frequencies(HaplotypeSet & reference)
+   {
+   if (freq == NULL) return reference.freq;
+
+   int thread = Thread();
+
+   return thread < threads ? freq[threadNode[thread]] : reference.freq;
+   }
@@ -0,0 +1,57 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __NUMAREPLICAS_H__
+#define __NUMAREPLICAS_H__
+
+#include "HaplotypeSet.h"
+#include "IntArray.h"
+
+// Keeps one copy of the read-only reference panel on each NUMA node and
+// pins worker threads to the processors of a node, so that each thread
+// walks a copy of the panel in local memory. With a single node or
+// thread, or where the topology is unknown, threads use the original
+// panel and are left unpinned. Teams of threads that share the states of
+// one haplotype also use the original panel, since their members run on
+// different nodes.
+class NumaReplicas
+   {
+   public:
+      int      nodes;
+
+      NumaReplicas();
+      ~NumaReplicas();
+
+      bool     Replicate(HaplotypeSet & reference);
+
+      // Panel copies for the calling thread
+      char **  Haplotypes(HaplotypeSet & reference);
+      float ** Frequencies(HaplotypeSet & reference);
+
+   private:
+      int      count, markers;
+      int      threads;
+      IntArray threadNode;
+      IntArray * nodeCpus;
+      char *** haplotypes;
+      float *** freq;
+
+      bool     ReadTopology();
+      bool     PinThread(int thread);
+      int      Thread();
+   };
+
+#endif
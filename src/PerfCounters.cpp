@@ -0,0 +1,244 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "PerfCounters.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static const char * phaseNames[PERF_PHASES] =
+   { "Forward", "Backward", "Estimation", "Output" };
+
+// Cache lines brought in for each last level cache miss
+#define CACHE_LINE 64
+
+PerfCounters::PerfCounters()
+   {
+   enabled = false;
+   threads = 0;
+   descriptors = NULL;
+   snapshots = NULL;
+
+   for (int e = 0; e < PERF_EVENTS; e++)
+      available[e] = true;
+
+   for (int p = 0; p < PERF_PHASES; p++)
+      {
+      markers[p] = 0.0;
+      for (int e = 0; e < PERF_EVENTS; e++)
+         totals[p][e] = 0.0;
+      }
+   }
+
+PerfCounters::~PerfCounters()
+   {
+   if (descriptors != NULL)
+      {
+      for (int t = 0; t < threads; t++)
+         for (int e = 0; e < PERF_EVENTS; e++)
+            if (descriptors[t][e] >= 0)
+               close(descriptors[t][e]);
+
+      delete [] descriptors;
+      delete [] snapshots;
+      }
+   }
+
+bool PerfCounters::Enable()
+   {
+#ifdef __linux__
+   threads = 1;
+#ifdef _OPENMP
+   threads = omp_get_max_threads();
+#endif
+
+   descriptors = new int [threads][PERF_EVENTS];
+   snapshots = new double [threads][PERF_EVENTS];
+
+   for (int t = 0; t < threads; t++)
+      for (int e = 0; e < PERF_EVENTS; e++)
+         descriptors[t][e] = -1;
+
+   // Check that the kernel lets us count this thread at all; the
+   // other threads open their counters the first time they start one
+   if (!Open(0))
+      {
+      printf("  Hardware performance counters unavailable (%s)\n", strerror(errno));
+      return false;
+      }
+
+   enabled = true;
+   return true;
+#else
+   printf("  Hardware performance counters are only supported on Linux\n");
+   return false;
+#endif
+   }
+
+// Opens a counter group for the calling thread, led by the cycle counter
+bool PerfCounters::Open(int thread)
+   {
+#ifdef __linux__
+   static const unsigned int types[PERF_EVENTS] =
+      { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+   static const unsigned long long configs[PERF_EVENTS] =
+      { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_STALLED_CYCLES_BACKEND };
+
+   int leader = -1;
+
+   for (int e = 0; e < PERF_EVENTS; e++)
+      {
+      if (!available[e]) continue;
+
+      struct perf_event_attr attr;
+
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[e];
+      attr.config = configs[e];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                         PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+
+      if (fd < 0)
+         {
+         // Without cycles there is no group; other events are optional
+         if (e == PERF_CYCLES) return false;
+
+         if (thread == 0) available[e] = false;
+         continue;
+         }
+
+      descriptors[thread][e] = fd;
+      if (leader < 0) leader = fd;
+      }
+
+   return true;
+#else
+   return false;
+#endif
+   }
+
+bool PerfCounters::Read(int thread, double * values)
+   {
+#ifdef __linux__
+   if (descriptors[thread][PERF_CYCLES] < 0 && !Open(thread))
+      return false;
+
+   // nr, time enabled, time running, then a (value, id) pair per event
+   unsigned long long buffer[3 + 2 * PERF_EVENTS];
+
+   if (read(descriptors[thread][PERF_CYCLES], buffer, sizeof(buffer)) <= 0)
+      return false;
+
+   // Scale up counts if the kernel had to multiplex the counters
+   double scale = buffer[2] ? (double) buffer[1] / buffer[2] : 1.0;
+
+   for (int e = 0, slot = 0; e < PERF_EVENTS; e++)
+      if (descriptors[thread][e] >= 0 && slot < (int) buffer[0])
+         values[e] = buffer[3 + 2 * slot++] * scale;
+      else
+         values[e] = 0.0;
+
+   return true;
+#else
+   return false;
+#endif
+   }
+
+void PerfCounters::Start(int phase)
+   {
+   if (!enabled) return;
+
+   int thread = 0;
+#ifdef _OPENMP
+   thread = omp_get_thread_num();
+#endif
+
+   if (thread < threads)
+      Read(thread, snapshots[thread]);
+   }
+
+void PerfCounters::Stop(int phase, double markerCount)
+   {
+   if (!enabled) return;
+
+   int thread = 0;
+#ifdef _OPENMP
+   thread = omp_get_thread_num();
+#endif
+
+   double values[PERF_EVENTS];
+
+   if (thread >= threads || !Read(thread, values))
+      return;
+
+   #pragma omp critical(perfCounters)
+      {
+      for (int e = 0; e < PERF_EVENTS; e++)
+         totals[phase][e] += values[e] - snapshots[thread][e];
+
+      markers[phase] += markerCount;
+      }
+   }
+
+void PerfCounters::Report()
+   {
+   if (!enabled) return;
+
+   printf("\nHardware Performance Counters (all threads)\n");
+   printf("  %-12s %12s %12s %6s %12s %12s %10s %12s\n",
+          "Phase", "Cycles", "Instructions", "IPC", "LLC Misses",
+          "Br Misses", "Stalled%", "Bytes/Marker");
+
+   for (int p = 0; p < PERF_PHASES; p++)
+      {
+      double * t = totals[p];
+
+      if (t[PERF_CYCLES] <= 0.0) continue;
+
+      printf("  %-12s %12.4g %12.4g %6.2f %12.4g %12.4g ",
+             phaseNames[p], t[PERF_CYCLES], t[PERF_INSTRUCTIONS],
+             t[PERF_INSTRUCTIONS] / t[PERF_CYCLES],
+             t[PERF_LLC_MISSES], t[PERF_BRANCH_MISSES]);
+
+      if (available[PERF_STALLED_CYCLES])
+         printf("%9.1f%% ", t[PERF_STALLED_CYCLES] / t[PERF_CYCLES] * 100.0);
+      else
+         printf("%10s ", "-");
+
+      if (markers[p] > 0.0 && available[PERF_LLC_MISSES])
+         printf("%12.1f\n", t[PERF_LLC_MISSES] * CACHE_LINE / markers[p]);
+      else
+         printf("%12s\n", "-");
+      }
+   }
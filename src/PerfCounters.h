@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+// Per-thread hardware performance counters, read through the Linux
+// perf_event_open interface and accumulated for each phase of a run.
+// Where counters are not available, every call is a no-op.
+
+#define PERF_FORWARD        0
+#define PERF_BACKWARD       1
+#define PERF_ESTIMATION     2
+#define PERF_OUTPUT         3
+#define PERF_PHASES         4
+
+#define PERF_CYCLES         0
+#define PERF_INSTRUCTIONS   1
+#define PERF_LLC_MISSES     2
+#define PERF_BRANCH_MISSES  3
+#define PERF_STALLED_CYCLES 4
+#define PERF_EVENTS         5
+
+class PerfCounters
+   {
+   public:
+      bool     enabled;
+
+      PerfCounters();
+      ~PerfCounters();
+
+      bool     Enable();
+
+      void     Start(int phase);
+      void     Stop(int phase, double markers = 0.0);
+
+      void     Report();
+
+   private:
+      int      threads;
+      int   (* descriptors)[PERF_EVENTS];
+      double (* snapshots)[PERF_EVENTS];
+      bool     available[PERF_EVENTS];
+
+      double   totals[PERF_PHASES][PERF_EVENTS];
+      double   markers[PERF_PHASES];
+
+      bool     Open(int thread);
+      bool     Read(int thread, double * values);
+   };
+
+#endif
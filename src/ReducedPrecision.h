@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __REDUCEDPRECISION_H__
+#define __REDUCEDPRECISION_H__
+
+#include <string.h>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// Storage formats for rows of the forward matrix. Arithmetic is always
+// carried out in float; rows are only converted as they are stored and
+// read back. Rows are normalized to sum to one at each marker before
+// storage, so only relative precision matters and the formats never
+// need to represent the tiny likelihoods of long haplotypes.
+
+#define PRECISION_FLOAT    0
+#define PRECISION_BF16     1
+#define PRECISION_F16      2
+
+// bfloat16: the float exponent with 8 bits of mantissa
+struct BFloat16Storage
+   {
+   typedef unsigned short Type;
+
+   static inline Type Encode(float value)
+      {
+      unsigned int bits;
+      memcpy(&bits, &value, sizeof(bits));
+
+      // Round to nearest, ties to even
+      bits += 0x7FFF + ((bits >> 16) & 1);
+
+      return (Type) (bits >> 16);
+      }
+
+   static inline float Decode(Type value)
+      {
+      unsigned int bits = (unsigned int) value << 16;
+      float result;
+
+      memcpy(&result, &bits, sizeof(result));
+
+      return result;
+      }
+   };
+
+// IEEE half precision: 11 bits of mantissa, but values below 6e-8 are
+// flushed to zero, so states that become very unlikely in one direction
+// are lost even if the other sweep favours them
+struct HalfStorage
+   {
+   typedef unsigned short Type;
+
+   static inline Type Encode(float value)
+      {
+#ifdef __F16C__
+      return _cvtss_sh(value, 0);
+#else
+      unsigned int bits;
+      memcpy(&bits, &value, sizeof(bits));
+
+      unsigned int sign = (bits >> 16) & 0x8000;
+      unsigned int mantissa = bits & 0x7FFFFF;
+      int exponent = (int) ((bits >> 23) & 0xFF) - 127 + 15;
+
+      if (exponent >= 31)
+         return (Type) (sign | 0x7C00);
+
+      if (exponent <= 0)
+         {
+         // Subnormal results, rounded to nearest, ties to even
+         if (exponent < -10)
+            return (Type) sign;
+
+         mantissa |= 0x800000;
+
+         int shift = 14 - exponent;
+         unsigned int half = mantissa >> shift;
+         unsigned int rest = mantissa & ((1u << shift) - 1);
+         unsigned int halfway = 1u << (shift - 1);
+
+         if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+
+         return (Type) (sign | half);
+         }
+
+      unsigned int half = ((unsigned int) exponent << 10) | (mantissa >> 13);
+      unsigned int rest = mantissa & 0x1FFF;
+
+      // A carry out of the mantissa correctly bumps the exponent
+      if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+         half++;
+
+      return (Type) (sign | half);
+#endif
+      }
+
+   static inline float Decode(Type value)
+      {
+#ifdef __F16C__
+      return _cvtsh_ss(value);
+#else
+      unsigned int sign = (unsigned int) (value & 0x8000) << 16;
+      unsigned int exponent = (value >> 10) & 0x1F;
+      unsigned int mantissa = value & 0x3FF;
+      unsigned int bits;
+
+      if (exponent == 0)
+         {
+         float result = mantissa * 5.9604644775390625e-8f;
+         return sign ? -result : result;
+         }
+
+      if (exponent == 31)
+         bits = sign | 0x7F800000 | (mantissa << 13);
+      else
+         bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+      float result;
+      memcpy(&result, &bits, sizeof(result));
+
+      return result;
+#endif
+      }
+   };
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "RunMetrics.h"
+#include "InputFile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+RunMetrics::RunMetrics()
+   {
+   runStart = phaseWall = WallTime();
+   phaseCpu = CpuTime();
+   }
+
+double RunMetrics::WallTime()
+   {
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+
+   return now.tv_sec + now.tv_usec * 1e-6;
+   }
+
+double RunMetrics::CpuTime()
+   {
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+   }
+
+// Peak resident set size in bytes, since the last reset if the kernel
+// supports resetting it, or for the whole run otherwise
+double RunMetrics::PeakMemory()
+   {
+   FILE * status = fopen("/proc/self/status", "r");
+
+   if (status != NULL)
+      {
+      char   line[256];
+      double kb = -1.0;
+
+      while (fgets(line, sizeof(line), status) != NULL)
+         if (strncmp(line, "VmHWM:", 6) == 0)
+            sscanf(line + 6, "%lf", &kb);
+
+      fclose(status);
+
+      if (kb >= 0.0)
+         return kb * 1024.0;
+      }
+
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+
+   return usage.ru_maxrss * 1024.0;
+   }
+
+void RunMetrics::ResetPeakMemory()
+   {
+   FILE * refs = fopen("/proc/self/clear_refs", "w");
+
+   if (refs == NULL) return;
+
+   fputs("5", refs);
+   fclose(refs);
+   }
+
+void RunMetrics::BeginPhase(const char * name)
+   {
+   names.Push(name);
+
+   ResetPeakMemory();
+
+   phaseWall = WallTime();
+   phaseCpu = CpuTime();
+   }
+
+void RunMetrics::EndPhase(double haps, double stateMarkers)
+   {
+   wall.Push(WallTime() - phaseWall);
+   cpu.Push(CpuTime() - phaseCpu);
+   haplotypes.Push(haps);
+   updates.Push(stateMarkers);
+   peakMemory.Push(PeakMemory());
+   }
+
+void RunMetrics::WriteJSON(const char * filename, int threads)
+   {
+   IFILE output = ifopen(filename, "wb");
+
+   if (output == NULL) return;
+
+   ifprintf(output, "{\n  \"threads\": %d,\n  \"wallSeconds\": %.3f,\n  \"cpuSeconds\": %.3f,\n"
+                    "  \"peakMemoryBytes\": %.0f,\n  \"phases\": [\n",
+            threads, WallTime() - runStart, CpuTime(), peakMemory.Length() ? peakMemory.Max() : PeakMemory());
+
+   for (int i = 0; i < wall.Length(); i++)
+      ifprintf(output, "    { \"name\": \"%s\", \"wallSeconds\": %.3f, \"cpuSeconds\": %.3f, "
+                       "\"haplotypes\": %.0f, \"haplotypesPerSecond\": %.3f, "
+                       "\"stateMarkerUpdates\": %.0f, \"stateMarkerUpdatesPerSecond\": %.4g, "
+                       "\"peakMemoryBytes\": %.0f }%s\n",
+               (const char *) names[i], wall[i], cpu[i],
+               haplotypes[i], haplotypes[i] / (wall[i] + 1e-9),
+               updates[i], updates[i] / (wall[i] + 1e-9),
+               peakMemory[i], i + 1 < wall.Length() ? "," : "");
+
+   ifprintf(output, "  ]\n}\n");
+   ifclose(output);
+   }
+
+ProgressMeter::ProgressMeter(const char * LABEL, int TOTAL, double INTERVAL)
+   {
+   label = LABEL;
+   total = TOTAL;
+   interval = INTERVAL;
+   completed = 0;
+   start = RunMetrics::WallTime();
+   nextReport = start + interval;
+   }
+
+void ProgressMeter::Update(int increment)
+   {
+   #pragma omp atomic
+   completed += increment;
+
+   // Cheap unsynchronized check, so most updates never take the lock
+   double now = RunMetrics::WallTime();
+
+   if (now < nextReport) return;
+
+   #pragma omp critical(progress)
+   if (now >= nextReport)
+      {
+      Report(now);
+      nextReport = now + interval;
+      }
+   }
+
+void ProgressMeter::Finish()
+   {
+   Report(RunMetrics::WallTime());
+   }
+
+void ProgressMeter::Report(double now)
+   {
+   double elapsed = now - start;
+   double rate = completed / (elapsed + 1e-9);
+
+   printf("  %d", completed);
+   if (total > 0)
+      printf(" of %d", total);
+   printf(" %s (%.1f/s", (const char *) label, rate);
+
+   if (total > 0 && completed > 0 && completed < total)
+      {
+      int eta = (int) ((total - completed) / rate);
+
+      printf(", ETA %d hours, %d mins, %d seconds", eta / 3600, (eta % 3600) / 60, eta % 60);
+      }
+
+   printf(")\n");
+   }
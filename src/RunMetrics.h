@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RUNMETRICS_H__
+#define __RUNMETRICS_H__
+
+#include "StringArray.h"
+#include "MathVector.h"
+
+// Records wall time, CPU time, throughput and peak memory use for each
+// phase of a run, and writes them as JSON at the end.
+class RunMetrics
+   {
+   public:
+      RunMetrics();
+
+      void   BeginPhase(const char * name);
+      void   EndPhase(double haplotypes = 0.0, double stateMarkers = 0.0);
+
+      void   WriteJSON(const char * filename, int threads);
+
+      static double WallTime();
+      static double CpuTime();
+      static double PeakMemory();
+      static void   ResetPeakMemory();
+
+   private:
+      StringArray names;
+      Vector      wall, cpu, haplotypes, updates, peakMemory;
+      double      runStart, phaseWall, phaseCpu;
+   };
+
+// Prints a progress line with throughput and an estimated time to
+// completion, at most once per interval. Safe to call from many threads.
+class ProgressMeter
+   {
+   public:
+      ProgressMeter(const char * label, int total, double interval = 5.0);
+
+      void   Update(int increment = 1);
+      void   Finish();
+
+   private:
+      String label;
+      int    total, completed;
+      double start, interval, nextReport;
+
+      void   Report(double now);
+   };
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ScratchMatrix.h"
+#include "Error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Rows are written and fetched in windows of about this many bytes
+#define SCRATCH_WINDOW     (4 * 1024 * 1024)
+
+ScratchMatrix::ScratchMatrix()
+   {
+   rows = NULL;
+   base = NULL;
+   bytes = rowBytes = 0;
+   file = -1;
+   count = window = 0;
+   }
+
+ScratchMatrix::~ScratchMatrix()
+   {
+   Free();
+   }
+
+float ** ScratchMatrix::Allocate(const char * directory, int ROWS, int width)
+   {
+   Free();
+
+   char * filename = new char [strlen(directory) + 32];
+   sprintf(filename, "%s/minimac-scratch-XXXXXX", directory);
+
+   file = mkstemp(filename);
+
+   if (file < 0)
+      error("Scratch file for the forward matrix could not be created in [%s]\n", directory);
+
+   // Nothing else needs the file, so it goes away with the mapping
+   unlink(filename);
+   delete [] filename;
+
+   count = ROWS;
+   rowBytes = (size_t) width * sizeof(float);
+   bytes = rowBytes * count;
+   window = SCRATCH_WINDOW / rowBytes;
+   if (window < 1) window = 1;
+
+   if (ftruncate(file, bytes) != 0)
+      error("Scratch file for the forward matrix could not be extended to %.0f MB in [%s]\n",
+            bytes / 1048576.0, directory);
+
+   void * mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+
+   if (mapping == MAP_FAILED)
+      error("Scratch file for the forward matrix could not be mapped in [%s]\n", directory);
+
+   base = (char *) mapping;
+
+   rows = new float * [count];
+   for (int i = 0; i < count; i++)
+      rows[i] = (float *) (base + rowBytes * i);
+
+   return rows;
+   }
+
+void ScratchMatrix::Free()
+   {
+   if (base != NULL)
+      munmap(base, bytes);
+
+   if (file >= 0)
+      close(file);
+
+   if (rows != NULL)
+      delete [] rows;
+
+   rows = NULL;
+   base = NULL;
+   file = -1;
+   bytes = 0;
+   }
+
+void ScratchMatrix::Advise(int first, int last, int advice)
+   {
+   if (first < 0) first = 0;
+   if (last > count) last = count;
+   if (first >= last) return;
+
+   // Ranges must start on a page boundary
+   size_t page = sysconf(_SC_PAGESIZE);
+   size_t start = rowBytes * first / page * page;
+
+   madvise(base + start, rowBytes * last - start, advice);
+   }
+
+void ScratchMatrix::WriteBehind(int row)
+   {
+   if (base == NULL || (row % window != window - 1 && row != count - 1))
+      return;
+
+   size_t start = rowBytes * (row - row % window);
+   size_t end = rowBytes * (row + 1);
+
+#ifdef __linux__
+   sync_file_range(file, start, end - start, SYNC_FILE_RANGE_WRITE);
+#else
+   size_t page = sysconf(_SC_PAGESIZE);
+   msync(base + start / page * page, end - start / page * page, MS_ASYNC);
+#endif
+   }
+
+void ScratchMatrix::ReadAhead(int row)
+   {
+   if (base == NULL || row % window != 0)
+      return;
+
+   Advise(row - window, row, MADV_WILLNEED);
+   Advise(row + window, row + 2 * window, MADV_DONTNEED);
+   }
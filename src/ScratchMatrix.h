@@ -0,0 +1,57 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SCRATCHMATRIX_H__
+#define __SCRATCHMATRIX_H__
+
+#include <stddef.h>
+
+// Rows of a forward matrix backed by a memory mapped scratch file, so that
+// under memory pressure the operating system writes them to disk and reads
+// them back instead of swapping. Rows are expected to be written from the
+// first to the last and then read in reverse, which the hints below turn
+// into streaming writes and reads of a few megabytes at a time. The file
+// is removed as soon as it is created, and disappears with the mapping.
+class ScratchMatrix
+   {
+   public:
+      ScratchMatrix();
+      ~ScratchMatrix();
+
+      // Rows of width floats in a new file under directory
+      float ** Allocate(const char * directory, int rows, int width);
+      void     Free();
+
+      bool     IsOpen() { return base != NULL; }
+
+      // Called after each row of a forward sweep, starting writes of
+      // completed windows of rows
+      void     WriteBehind(int row);
+
+      // Called before each row of a backward sweep, fetching the window
+      // below and releasing the one above
+      void     ReadAhead(int row);
+
+   private:
+      float ** rows;
+      char *   base;
+      size_t   bytes, rowBytes;
+      int      file, count, window;
+
+      void     Advise(int first, int last, int advice);
+   };
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "Error.h"
+#include "IntArray.h"
+#include "Parameters.h"
+#include "StringBasics.h"
+#include "MemoryAllocators.h"
+#include "InputFile.h"
+#include "Random.h"
+
+#include <math.h>
+
+// Generates synthetic reference and target haplotypes in the formats
+// expected by --refHaps/--refSnps and --haps/--snps. Haplotypes are
+// mosaics of a small set of founder haplotypes, so the panel has
+// realistic haplotype sharing and can be imputed. The full target
+// haplotypes are also summarized as true dosages for concordance checks.
+
+static const char bases[] = {0, 'A', 'C', 'G', 'T'};
+
+class Simulation
+   {
+   public:
+      int      markers, founders;
+      double   switchesPerMb, mutationRate;
+      IntArray positions;
+      char **  founderHaplotypes;
+      char *   alleles[2];
+
+      Simulation(int markers, int founders, double spacing, double switchesPerMb,
+                 double mutationRate, double rareFraction);
+      ~Simulation();
+
+      void Sample(char * haplotype);
+   };
+
+Simulation::Simulation(int MARKERS, int FOUNDERS, double spacing, double switches,
+                       double mutation, double rareFraction)
+   {
+   markers = MARKERS;
+   founders = FOUNDERS;
+   switchesPerMb = switches;
+   mutationRate = mutation;
+
+   positions.Dimension(markers);
+   founderHaplotypes = AllocateCharMatrix(founders, markers);
+   alleles[0] = new char [markers];
+   alleles[1] = new char [markers];
+
+   int position = 1000000;
+
+   for (int j = 0; j < markers; j++)
+      {
+      // Exponential spacing, so marker density varies along the region
+      position += 1 + (int) (-log(1.0 - globalRandom.Next()) * spacing);
+      positions[j] = position;
+
+      // Two distinct alleles per marker
+      alleles[0][j] = 1 + (int) (globalRandom.Next() * 4);
+      alleles[1][j] = 1 + (alleles[0][j] + (int) (globalRandom.Next() * 3)) % 4;
+
+      // Skew frequencies towards rare variants, as in sequenced panels
+      double freq = globalRandom.Next() < rareFraction ?
+                    globalRandom.Next() * 0.01 : 0.01 + globalRandom.Next() * 0.49;
+
+      for (int i = 0; i < founders; i++)
+         founderHaplotypes[i][j] = globalRandom.Next() < freq;
+      }
+   }
+
+Simulation::~Simulation()
+   {
+   FreeCharMatrix(founderHaplotypes, founders);
+
+   delete [] alleles[0];
+   delete [] alleles[1];
+   }
+
+void Simulation::Sample(char * haplotype)
+   {
+   int founder = (int) (globalRandom.Next() * founders);
+
+   for (int j = 0; j < markers; j++)
+      {
+      if (j > 0)
+         {
+         double distance = (positions[j] - positions[j - 1]) * 1e-6;
+
+         if (globalRandom.Next() < 1.0 - exp(-distance * switchesPerMb))
+            founder = (int) (globalRandom.Next() * founders);
+         }
+
+      int allele = founderHaplotypes[founder][j];
+
+      if (globalRandom.Next() < mutationRate)
+         allele = 1 - allele;
+
+      haplotype[j] = alleles[allele][j];
+      }
+   }
+
+int main(int argc, char ** argv)
+   {
+   setbuf(stdout, NULL);
+
+   int    referenceCount = 1000, targetCount = 100, markers = 10000;
+   int    founders = 100, seed = 123456;
+   double spacing = 500, switchesPerMb = 20, mutationRate = 0.001;
+   double rareFraction = 0.6, typedFraction = 0.1, missingRate = 0.01;
+   String prefix("simulated");
+
+   BEGIN_LONG_PARAMETERS(longParameters)
+      LONG_PARAMETER_GROUP("Panel")
+         LONG_INTPARAMETER("reference", &referenceCount)
+         LONG_INTPARAMETER("targets", &targetCount)
+         LONG_INTPARAMETER("markers", &markers)
+         LONG_DOUBLEPARAMETER("spacing", &spacing)
+         LONG_DOUBLEPARAMETER("rareFraction", &rareFraction)
+      LONG_PARAMETER_GROUP("Mosaic")
+         LONG_INTPARAMETER("founders", &founders)
+         LONG_DOUBLEPARAMETER("switchesPerMb", &switchesPerMb)
+         LONG_DOUBLEPARAMETER("mutationRate", &mutationRate)
+      LONG_PARAMETER_GROUP("Target Array")
+         LONG_DOUBLEPARAMETER("typed", &typedFraction)
+         LONG_DOUBLEPARAMETER("missing", &missingRate)
+      LONG_PARAMETER_GROUP("Output")
+         LONG_STRINGPARAMETER("prefix", &prefix)
+         LONG_INTPARAMETER("seed", &seed)
+   END_LONG_PARAMETERS();
+
+   ParameterList pl;
+
+   pl.Add(new LongParameters("Command Line Options", longParameters));
+   pl.Read(argc, argv);
+   pl.Status();
+
+   if (markers < 2 || founders < 1 || referenceCount < 2 || targetCount < 1)
+      error("At least 2 markers, 1 founder, 2 reference haplotypes and 1 target are required\n");
+
+   globalRandom.Reset(seed);
+
+   Simulation simulation(markers, founders, spacing, switchesPerMb, mutationRate, rareFraction);
+
+   char * haplotype = new char [markers];
+   int ** counts = AllocateIntMatrix(5, markers);
+
+   for (int a = 0; a < 5; a++)
+      for (int j = 0; j < markers; j++)
+         counts[a][j] = 0;
+
+   // Reference panel
+   printf("Writing %d reference haplotypes for %d markers ...\n", referenceCount, markers);
+
+   IFILE snps = ifopen(prefix + ".ref.snps", "wt");
+   IFILE haps = ifopen(prefix + ".ref.haps", "wt");
+
+   if (snps == NULL || haps == NULL)
+      error("Output files with prefix [%s] could not be opened\n", (const char *) prefix);
+
+   for (int j = 0; j < markers; j++)
+      ifprintf(snps, "20:%d\n", simulation.positions[j]);
+
+   for (int i = 0; i < referenceCount; i++)
+      {
+      simulation.Sample(haplotype);
+
+      ifprintf(haps, "REF%d->REF%d HAPLO%d ", i / 2 + 1, i / 2 + 1, i % 2 + 1);
+      for (int j = 0; j < markers; j++)
+         {
+         ifprintf(haps, "%c", bases[haplotype[j]]);
+         counts[haplotype[j]][j]++;
+         }
+      ifprintf(haps, "\n");
+      }
+
+   ifclose(snps);
+   ifclose(haps);
+
+   // Major alleles are chosen as in HaplotypeSet::ListMajorAlleles()
+   char * major = new char [markers];
+
+   for (int j = 0; j < markers; j++)
+      {
+      major[j] = 1;
+
+      for (int a = 2; a < 5; a++)
+         if (counts[a][j] >= counts[major[j]][j])
+            major[j] = a;
+      }
+
+   // Target array markers
+   IntArray typed;
+
+   for (int j = 0; j < markers; j++)
+      if (globalRandom.Next() < typedFraction)
+         typed.Push(j);
+
+   if (typed.Length() == 0)
+      typed.Push(markers / 2);
+
+   printf("Writing %d target individuals typed at %d markers ...\n", targetCount, typed.Length());
+
+   snps = ifopen(prefix + ".snps", "wt");
+   haps = ifopen(prefix + ".haps", "wt");
+   IFILE truth = ifopen(prefix + ".truth.dose", "wt");
+
+   if (snps == NULL || haps == NULL || truth == NULL)
+      error("Output files with prefix [%s] could not be opened\n", (const char *) prefix);
+
+   for (int j = 0; j < typed.Length(); j++)
+      ifprintf(snps, "20:%d\n", simulation.positions[typed[j]]);
+
+   IntArray dose(markers);
+   char * missing = new char [typed.Length()];
+
+   for (int i = 0; i < targetCount; i++)
+      {
+      dose.Zero();
+
+      // Missing genotypes affect both haplotypes of an individual
+      for (int j = 0; j < typed.Length(); j++)
+         missing[j] = globalRandom.Next() < missingRate;
+
+      for (int h = 0; h < 2; h++)
+         {
+         simulation.Sample(haplotype);
+
+         ifprintf(haps, "SAMPLE%d->SAMPLE%d HAPLO%d ", i + 1, i + 1, h + 1);
+         for (int j = 0; j < typed.Length(); j++)
+            ifprintf(haps, "%c", missing[j] ? '0' : bases[haplotype[typed[j]]]);
+         ifprintf(haps, "\n");
+
+         for (int j = 0; j < markers; j++)
+            dose[j] += haplotype[j] == major[j];
+         }
+
+      ifprintf(truth, "SAMPLE%d->SAMPLE%d\tDOSE", i + 1, i + 1);
+      for (int j = 0; j < markers; j++)
+         ifprintf(truth, "\t%d", dose[j]);
+      ifprintf(truth, "\n");
+      }
+
+   ifclose(snps);
+   ifclose(haps);
+   ifclose(truth);
+
+   FreeIntMatrix(counts, 5);
+
+   delete [] haplotype;
+   delete [] major;
+   delete [] missing;
+
+   printf("Simulated data written to %s.*\n", (const char *) prefix);
+   }
@@ -0,0 +1,155 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "TraceRecorder.h"
+#include "InputFile.h"
+
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+TraceRecorder::TraceRecorder()
+   {
+   enabled = false;
+   threads = 0;
+   names = 0;
+   begins = durations = NULL;
+   events = NULL;
+   start = 0.0;
+   }
+
+TraceRecorder::~TraceRecorder()
+   {
+   if (begins != NULL) delete [] begins;
+   if (durations != NULL) delete [] durations;
+   if (events != NULL) delete [] events;
+   }
+
+void TraceRecorder::Enable()
+   {
+   threads = 1;
+#ifdef _OPENMP
+   threads = omp_get_max_threads();
+#endif
+
+   begins = new Vector [threads];
+   durations = new Vector [threads];
+   events = new IntArray [threads];
+
+   enabled = true;
+   start = Now();
+   }
+
+// Microseconds since tracing was enabled
+double TraceRecorder::Now()
+   {
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+
+   return now.tv_sec * 1e6 + now.tv_usec - start;
+   }
+
+// Span names are string literals, so they are matched by address first
+int TraceRecorder::NameIndex(const char * name)
+   {
+   int index;
+
+   // Names are only ever appended, so look for known names without locking
+   for (index = 0; index < names; index++)
+      if (nameTable[index] == name)
+         return index;
+
+   #pragma omp critical(traceNames)
+      {
+      for (index = 0; index < names; index++)
+         if (nameTable[index] == name || strcmp(nameTable[index], name) == 0)
+            break;
+
+      if (index == names && names < 64)
+         nameTable[names++] = name;
+      }
+
+   return index < 64 ? index : 63;
+   }
+
+void TraceRecorder::Record(const char * name, double begin, double end)
+   {
+   if (!enabled) return;
+
+   int thread = 0;
+#ifdef _OPENMP
+   thread = omp_get_thread_num();
+#endif
+
+   if (thread >= threads) return;
+
+   begins[thread].Push(begin);
+   durations[thread].Push(end - begin);
+   events[thread].Push(NameIndex(name));
+   }
+
+void TraceRecorder::WriteJSON(const char * filename)
+   {
+   IFILE output = ifopen(filename, "wb");
+
+   if (output == NULL) return;
+
+   ifprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+   bool first = true;
+   for (int t = 0; t < threads; t++)
+      {
+      ifprintf(output, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                       "\"args\":{\"name\":\"worker %d\"}}",
+               first ? "" : ",\n", t, t);
+      first = false;
+
+      for (int i = 0; i < events[t].Length(); i++)
+         ifprintf(output, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                          "\"ts\":%.1f,\"dur\":%.1f}",
+                  nameTable[events[t][i]],
+                  strncmp(nameTable[events[t][i]], "Wait", 4) == 0 ? "lock" : "compute",
+                  t, begins[t][i], durations[t][i]);
+      }
+
+   ifprintf(output, "\n]}\n");
+   ifclose(output);
+   }
+
+TraceSpan::TraceSpan(TraceRecorder & RECORDER, const char * NAME) :
+   recorder(RECORDER)
+   {
+   name = NAME;
+   active = recorder.enabled;
+   begin = active ? recorder.Now() : 0.0;
+   }
+
+TraceSpan::~TraceSpan()
+   {
+   Stop();
+   }
+
+void TraceSpan::Stop()
+   {
+   if (!active) return;
+
+   recorder.Record(name, begin, recorder.Now());
+   active = false;
+   }
@@ -0,0 +1,70 @@
+/*
+ *  Copyright (C) 2011  Goncalo Abecasis
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TRACERECORDER_H__
+#define __TRACERECORDER_H__
+
+#include "IntArray.h"
+#include "MathVector.h"
+
+// Records begin/end spans for each thread and writes them in the Chrome
+// trace-event format, which can be opened in chrome://tracing or
+// Perfetto. When disabled, spans cost a single branch.
+class TraceRecorder
+   {
+   public:
+      bool     enabled;
+
+      TraceRecorder();
+      ~TraceRecorder();
+
+      void     Enable();
+
+      double   Now();
+      void     Record(const char * name, double begin, double end);
+
+      void     WriteJSON(const char * filename);
+
+   private:
+      int      threads;
+      double   start;
+      Vector * begins;
+      Vector * durations;
+      IntArray * events;
+
+      int      names;
+      const char * nameTable[64];
+
+      int      NameIndex(const char * name);
+   };
+
+// Records a span from construction until Stop() or destruction
+class TraceSpan
+   {
+   public:
+      TraceSpan(TraceRecorder & recorder, const char * name);
+      ~TraceSpan();
+
+      void     Stop();
+
+   private:
+      TraceRecorder & recorder;
+      const char *    name;
+      double          begin;
+      bool            active;
+   };
+
+#endif